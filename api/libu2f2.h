@@ -66,9 +66,13 @@
 
 #define MAGIC_USER_PRESENCE_REQ 0xae5d497fUL
 #define MAGIC_USER_PRESENCE_ACK 0xa97fe5d4UL
+/* user presence request carrying the appid, responded with metadata then presence */
+#define MAGIC_USER_PRESENCE_METADATA_REQ 0xae5d4f4cUL
 
 #define MAGIC_STORAGE_GET_METADATA 0x4f5d8f4cUL
 #define MAGIC_STORAGE_SET_METADATA 0x8f4c4f5dUL
+/* batched lookup of (appid, kh) candidates */
+#define MAGIC_STORAGE_LOOKUP_METADATA 0x4f5d8f4dUL
 
 
 #define MAGIC_STORAGE_GET_METADATA_STATUS 0x424a
@@ -83,6 +87,18 @@
 #define MAGIC_APPID_METADATA_ICON_START 0x4247
 #define MAGIC_APPID_METADATA_ICON 0x4248
 #define MAGIC_APPID_METADATA_END  0x4249
+#define MAGIC_APPID_LOOKUP_CANDIDATE 0x424b
+#define MAGIC_APPID_LOOKUP_RESULT    0x424c
+
+/*
+ * Stream tagging: the stream id (1 to 255, 0 for untagged legacy streams) is carried in
+ * bits 16-23 of the metadata stream mtypes, which are 16 bits values. The receptions by
+ * mtype then never match another stream leftovers.
+ */
+#define U2F2_STREAM_MTYPE(mtype, stream_id) ((uint32_t)(mtype) | ((uint32_t)(stream_id) << 16))
+#define U2F2_STREAM_ID(mtype)               ((uint8_t)(((uint32_t)(mtype) >> 16) & 0xff))
+#define U2F2_STREAM_BASE(mtype)             ((uint32_t)(mtype) & 0xffff)
+#define U2F2_IS_STREAM_MTYPE(mtype)         ((((uint32_t)(mtype)) & 0xff00fff0UL) == 0x4240UL)
 
 
 #define MAGIC_STORAGE_GET_ASSETS           0x4ed5e78cUL
@@ -91,6 +107,18 @@
 
 #define MAGIC_STORAGE_SD_ROLLBK_COUNTER    0x4ed81a70UL
 
+/* assets bundle (master key material + rollback counter), see request_assets() */
+#define MAGIC_STORAGE_GET_ASSETS_BUNDLE    0x4ed5e7a0UL
+#define MAGIC_STORAGE_ASSETS               0x4ed5e78dUL
+#define MAGIC_STORAGE_SET_ASSETS           0x4ed5e7a1UL
+#define MAGIC_STORAGE_SET_ASSETS_STATUS    0x4ed5e7a2UL
+
+/* SD rollback counter write-behind, see u2f2_rollbk_inc() */
+#define MAGIC_STORAGE_ROLLBK_INC           0x4ed81a71UL
+#define MAGIC_STORAGE_ROLLBK_FLUSH         0x4ed81a72UL
+#define MAGIC_STORAGE_ROLLBK_FLUSH_STATUS  0x4ed81a73UL
+#define MAGIC_STORAGE_ROLLBK_INC_ACK       0x4ed81a74UL
+
 
 #define MAGIC_STORAGE_INC_CTR              0x24a7fac1
 
@@ -160,8 +188,238 @@ mbed_error_t transmit_signal_to_backend_with_hooks(int source, int backend, uint
  */
 mbed_error_t handle_signal(int source, uint32_t sig, uint32_t resp, u2f2_transmit_signal_prehook_t hook);
 
+/*
+ * Probing a set of backends for readiness at once (MAGIC_IS_BACKEND_READY), and collecting
+ * their MAGIC_BACKEND_IS_READY acknowledges in any order.
+ * @targets      the backends message queues
+ * @num          the number of backends (up to 32)
+ * @timeout_ms   global deadline, in milliseconds (0: wait until all backends are ready)
+ * @ready_bitmap bit i is set if targets[i] is ready
+ * Returns MBED_ERROR_NOTREADY if the deadline is reached before all backends are ready.
+ */
+mbed_error_t wait_for_backends(const int *targets, uint8_t num, uint32_t timeout_ms, uint32_t *ready_bitmap);
+
+/*
+ * Proactively push MAGIC_BACKEND_IS_READY to a peer, without waiting for its probe.
+ * A pending MAGIC_IS_BACKEND_READY probe from this peer is consumed.
+ * @target the peer message queue
+ */
+mbed_error_t signal_backend_ready(int target);
+
+/*
+ * Priority classes. Control signals (wink, user presence, PIN, unlock, readiness) are
+ * high priority, any other mtype (metadata stream, APDU fragments...) is bulk.
+ */
+typedef enum {
+U2F2_PRIO_HIGH = 0,
+U2F2_PRIO_BULK = 1,
+} u2f2_msg_prio_t;
+
+/*
+ * Control signal received while a bulk stream was being handled, to be delivered
+ * by the next recv_msg_by_priority()
+ */
+typedef struct {
+    struct msgbuf msgbuf;
+    uint8_t       len;
+} u2f2_deferred_msg_t;
+
+/*
+ * Per-queue priority reception state.
+ */
+typedef struct {
+    int     source;
+    uint8_t high_in_row;    /* number of consecutive high priority messages received (saturating) */
+    uint8_t deferred_head;
+    uint8_t deferred_num;
+    u2f2_deferred_msg_t deferred[CONFIG_USR_LIB_U2F2_PRIO_DEFERRED_DEPTH];
+} u2f2_prio_ctx_t;
+
+/*
+ * Get the priority class of a given mtype
+ */
+u2f2_msg_prio_t u2f2_msg_priority(uint32_t mtype);
+
+/*
+ * Initialize the priority reception state of a given message queue
+ * @ctx    the priority context to initialize
+ * @source the message queue to receive from
+ */
+mbed_error_t u2f2_prio_init(u2f2_prio_ctx_t *ctx, int source);
+
+/*
+ * Defer a control signal received out of recv_msg_by_priority() (e.g. in the middle of
+ * a metadata stream). Returns MBED_ERROR_NOMEM if the deferred messages FIFO is full.
+ */
+mbed_error_t u2f2_prio_defer(u2f2_prio_ctx_t *ctx, const struct msgbuf *msgbuf, size_t len);
+
+/*
+ * Receiving the next message of a queue, high priority messages first. Deferred control
+ * signals are delivered first. Then, all the high priority mtypes are probed (without
+ * blocking), so that a pending control signal is always received before any bulk message.
+ * Note that this costs one non-blocking reception per high priority mtype for each bulk
+ * message received. After CONFIG_USR_LIB_U2F2_PRIO_MAX_HIGH_IN_ROW consecutive high priority
+ * messages, the oldest pending message is received, so that bulk transfers are not starved.
+ * Blocks until a message is received.
+ * @ctx    the priority context of the queue
+ * @msgbuf the received message
+ * @msgsz  the max size of the received message content
+ * @len    the effective size of the received message content
+ */
+mbed_error_t recv_msg_by_priority(u2f2_prio_ctx_t *ctx, struct msgbuf *msgbuf, size_t msgsz, ssize_t *len);
+
 /**** interacting with storage backend */
 
+/*
+ * (appid, kh) to storage slot index, shared by the sessions accessing the same storage.
+ * The cache is not locked: when shared by sessions handled in different threads, the
+ * caller must serialize the storage helpers calls of these sessions, or give each
+ * session its own cache.
+ */
+typedef struct {
+    uint8_t  appid[32];
+    uint8_t  kh[32];
+    uint8_t  hmac[32];
+    uint32_t slotid;
+    bool     hmac_valid;
+    bool     valid;
+} u2f2_slot_cache_entry_t;
+
+typedef struct {
+    u2f2_slot_cache_entry_t entries[CONFIG_USR_LIB_U2F2_SLOT_CACHE_SIZE];
+} u2f2_slot_cache_t;
+
+/*
+ * Initialize (empty) a slot cache
+ */
+mbed_error_t u2f2_slot_cache_init(u2f2_slot_cache_t *cache);
+
+/*
+ * Broken tagged stream, whose leftovers are still drained at each new request: the peer
+ * may still be sending the rest of the stream when the failure is detected.
+ */
+typedef struct {
+    uint8_t stream_id;    /* 0 if free */
+    uint8_t quiet_passes; /* number of consecutive drains without any leftover */
+} u2f2_dead_stream_t;
+
+/*
+ * Storage helpers session. All the per-call state of the storage helpers is held here,
+ * so that several sessions (one per message queue) can be handled concurrently.
+ * Note that the accesses to the storage itself (libfidostorage) are not protected here.
+ */
+typedef struct {
+    int       msq;              /* the session message queue */
+    uint8_t   template_kh[32];  /* template slot kh, for STORAGE_MODE_NEW_FROM_TEMPLATE */
+    uint8_t   template_hmac[32];/* template slot hmac, for STORAGE_MODE_NEW_FROM_TEMPLATE */
+    uint8_t  *icon_buf;         /* received icon buffer. If NULL, the icon is allocated with wmalloc */
+    uint16_t  icon_buf_len;
+    u2f2_slot_cache_t *slot_cache; /* slot index used by set_appid_metadata_r(), can be NULL */
+    bool      stream_tagging;   /* requests of this session use tagged streams */
+    uint8_t   stream_id;        /* current stream id, 0 if untagged */
+    u2f2_prio_ctx_t *prio;      /* control signals received during streams are deferred here, can be NULL */
+    u2f2_dead_stream_t dead_streams[CONFIG_USR_LIB_U2F2_DEAD_STREAMS];
+} u2f2_storage_session_t;
+
+/*
+ * Initialize a storage helpers session
+ * @session      the session to initialize
+ * @msq          the message queue of the session
+ * @icon_buf     caller-owned buffer for the received icons (can be NULL: dynamically allocated)
+ * @icon_buf_len the icon buffer size (0 if icon_buf is NULL)
+ */
+mbed_error_t u2f2_storage_session_init(u2f2_storage_session_t *session, int msq, uint8_t *icon_buf, uint16_t icon_buf_len);
+
+/*
+ * Attach a slot cache to a session. On UPDATE_EXISTING and NEW_FROM_TEMPLATE, set_appid_metadata_r()
+ * then resolves known credentials slots from the cache instead of walking the storage.
+ * The cache can be shared by several sessions, its accesses being serialized as the
+ * storage ones.
+ */
+mbed_error_t u2f2_storage_session_set_slot_cache(u2f2_storage_session_t *session, u2f2_slot_cache_t *cache);
+
+/*
+ * Enable stream tagging on the requests of a session (request_appid_metada_r() and
+ * request_user_presence_with_metadata_r()). A new stream id is then appended to each request
+ * and all the metadata stream messages carry it, so that the leftovers of a broken stream
+ * are never read back by the next one. Both peers must support it.
+ */
+mbed_error_t u2f2_storage_session_set_stream_tagging(u2f2_storage_session_t *session, bool enable);
+
+/*
+ * Attach the priority reception context of the session queue. Control signals received
+ * by set_appid_metadata_r() in the middle of the metadata stream are then deferred to it,
+ * and delivered by the next recv_msg_by_priority(), instead of breaking the stream.
+ * Without it (or once its deferred FIFO is full), the stream is received by its exact
+ * mtypes, control signals being left in the queue.
+ */
+mbed_error_t u2f2_storage_session_set_prio(u2f2_storage_session_t *session, u2f2_prio_ctx_t *prio);
+
+/*
+ * Get back the stream id of a received MAGIC_STORAGE_GET_METADATA, MAGIC_USER_PRESENCE_METADATA_REQ
+ * or MAGIC_STORAGE_SET_METADATA request, of len bytes, the untagged request content being base_len
+ * bytes. Returns 0 for untagged requests. On the backend side, it is to be set as the session
+ * stream_id before responding with send_appid_metadata_r() or set_appid_metadata_r().
+ */
+uint8_t u2f2_request_stream_id(const struct msgbuf *msgbuf, size_t len, size_t base_len);
+
+/*
+ * Resynchronize a session after a broken stream: the messages of the given stream already
+ * in the queue are dropped, without blocking, up to max_msgs messages.
+ * A tagged stream is also recorded as dead: its leftovers, which may still be emitted by
+ * the peer, are drained again at the beginning of the next requests of the session, until
+ * two drains in a row find none of them.
+ * Returns MBED_ERROR_BUSY if max_msgs is reached. This is done automatically by the
+ * storage helpers on failure.
+ */
+mbed_error_t u2f2_stream_resync(u2f2_storage_session_t *session, uint8_t stream_id, uint16_t max_msgs);
+
+/*
+ * The *_r() variants are reentrant, their state being held in the given session. When the
+ * session has an icon buffer, *appid_icon_p is set to it instead of being allocated.
+ * The legacy variants use a temporary session without icon buffer, nor stream tagging.
+ */
+mbed_error_t request_appid_metada_r(u2f2_storage_session_t *session, uint8_t *appid, fidostorage_appid_slot_t *appid_info, uint8_t    **appid_icon_p);
+
+mbed_error_t send_appid_metadata_r(u2f2_storage_session_t *session, uint8_t  *appid, fidostorage_appid_slot_t *appid_info, uint8_t    *appid_icon);
+
+mbed_error_t set_appid_metadata_r(__in  u2f2_storage_session_t *session,
+                                  __in  const u2f2_set_metadata_mode_t mode,
+                                  __out uint8_t   *buf,
+                                  __in  size_t    buf_len);
+
+/*
+ * Streaming write path of set_appid_metadata: only the slot header is kept in RAM, the icon
+ * chunks being written through to a staged slot, committed at MAGIC_APPID_METADATA_END.
+ */
+
+/* appid slot header: the slot content without the icon data, except the RGB color */
+#define U2F2_APPID_SLOT_HEADER_LEN (sizeof(fidostorage_appid_slot_t) - sizeof(fidostorage_icon_data_t) + 3)
+
+typedef struct {
+    /*
+     * Resolve the slot of (appid, kh) for STORAGE_MODE_UPDATE_EXISTING, or any slot of appid
+     * (kh is NULL) for STORAGE_MODE_NEW_FROM_TEMPLATE, and read back its header (at most
+     * U2F2_APPID_SLOT_HEADER_LEN bytes) and slotid.
+     */
+    mbed_error_t (*read_header)(u2f2_set_metadata_mode_t mode, const uint8_t *appid, const uint8_t *kh, fidostorage_appid_slot_t *header, uint32_t *slotid);
+    /* Write an icon chunk at offset in the staged slot */
+    mbed_error_t (*stage_icon)(uint16_t offset, const uint8_t *chunk, size_t len);
+    /*
+     * Atomically commit the staged slot with the given header to slotid (0: new slot, to be
+     * allocated and returned). src_slotid is the slot resolved by read_header (the template
+     * or the updated slot, 0 for STORAGE_MODE_NEW_FROM_SCRATCH): if icon_staged is false,
+     * its icon is kept.
+     */
+    mbed_error_t (*commit)(uint32_t *slotid, uint32_t src_slotid, const fidostorage_appid_slot_t *header, bool icon_staged);
+    /* Drop the staged slot (also called when nothing is staged yet) */
+    void (*abort)(void);
+} u2f2_set_metadata_stream_hooks_t;
+
+mbed_error_t set_appid_metadata_stream_r(__in  u2f2_storage_session_t *session,
+                                         __in  const u2f2_set_metadata_mode_t mode,
+                                         __in  const u2f2_set_metadata_stream_hooks_t *hooks);
+
 mbed_error_t request_appid_metada(int msq, uint8_t *appid, fidostorage_appid_slot_t *appid_info, uint8_t    **appid_icon_p);
 
 mbed_error_t send_appid_metadata(int msq, uint8_t  *appid, fidostorage_appid_slot_t *appid_info, uint8_t    *appid_icon);
@@ -171,5 +429,268 @@ mbed_error_t set_appid_metadata(__in  const int msq,
                                 __out uint8_t   *buf,
                                 __in  size_t    buf_len);
 
+/*
+ * User presence hook, executed by the backend once the appid metadata are sent.
+ * @user_present set to true if the user has confirmed its presence
+ */
+typedef mbed_error_t (*u2f2_user_presence_hook_t)(bool *user_present);
+
+/*
+ * Request user presence for a given appid, getting back in the same exchange the
+ * appid metadata (see request_appid_metada()) and the user presence result.
+ * If the appid is unknown, appid_info is left unset but user presence is still returned.
+ */
+mbed_error_t request_user_presence_with_metadata_r(u2f2_storage_session_t *session, uint8_t *appid, fidostorage_appid_slot_t *appid_info, uint8_t **appid_icon_p, bool *user_present);
+
+mbed_error_t request_user_presence_with_metadata(int msq, uint8_t *appid, fidostorage_appid_slot_t *appid_info, uint8_t **appid_icon_p, bool *user_present);
+
+/*
+ * Respond to MAGIC_USER_PRESENCE_METADATA_REQ: send the appid metadata (appid_info can be NULL
+ * if the appid doesn't exist), execute the presence hook and send back its result.
+ * The requester is always answered: if the metadata can't be sent or the hook fails, user
+ * absence is sent back.
+ */
+mbed_error_t send_appid_metadata_with_presence_r(u2f2_storage_session_t *session, uint8_t *appid, fidostorage_appid_slot_t *appid_info, uint8_t *appid_icon, u2f2_user_presence_hook_t hook);
+
+mbed_error_t send_appid_metadata_with_presence(int msq, uint8_t *appid, fidostorage_appid_slot_t *appid_info, uint8_t *appid_icon, u2f2_user_presence_hook_t hook);
+
+/**** batched appid lookup */
+
+/* selected index when no candidate exists */
+#define U2F2_LOOKUP_NONE 0xff
+
+typedef struct {
+    const uint8_t *appid;
+    const uint8_t *kh;
+} u2f2_lookup_candidate_t;
+
+typedef struct {
+    bool     exists;
+    uint32_t ctr;
+    uint32_t flags;
+} u2f2_lookup_result_t;
+
+/*
+ * Look up num (1 to 254) (appid, kh) candidates at once. results (num entries) are set with
+ * the existence, ctr and flags of each candidate. Only the first existing candidate is
+ * selected: its index is set in selected and its full metadata (see request_appid_metada())
+ * are received in appid_info and appid_icon_p.
+ * Returns MBED_ERROR_NOSTORAGE if no candidate exists (selected set to U2F2_LOOKUP_NONE).
+ */
+mbed_error_t request_appid_lookup_r(u2f2_storage_session_t *session, const u2f2_lookup_candidate_t *candidates, uint8_t num, u2f2_lookup_result_t *results, uint8_t *selected, fidostorage_appid_slot_t *appid_info, uint8_t **appid_icon_p);
+
+mbed_error_t request_appid_lookup(int msq, const u2f2_lookup_candidate_t *candidates, uint8_t num, u2f2_lookup_result_t *results, uint8_t *selected, fidostorage_appid_slot_t *appid_info, uint8_t **appid_icon_p);
+
+/*
+ * Respond to MAGIC_STORAGE_LOOKUP_METADATA, previously received in msgbuf (content of len bytes).
+ * The candidates are resolved in the storage as they are received. buf (at least
+ * sizeof(fidostorage_appid_slot_t) bytes) is used to read back the slots.
+ */
+mbed_error_t handle_appid_lookup_r(u2f2_storage_session_t *session, const struct msgbuf *msgbuf, size_t len, uint8_t *buf, size_t buf_len);
+
+mbed_error_t handle_appid_lookup(int msq, const struct msgbuf *msgbuf, size_t len, uint8_t *buf, size_t buf_len);
+
+
+/**** storage assets bundle */
+
+#define U2F2_ASSETS_MASTERKEY_LEN 32
+
+/*
+ * Storage assets, transmitted as a single message
+ */
+typedef struct {
+    uint8_t  masterkey[U2F2_ASSETS_MASTERKEY_LEN];
+    uint64_t rollback_ctr;
+} u2f2_assets_t;
+
+/*
+ * Assets commit hook, executed by the backend on MAGIC_STORAGE_SET_ASSETS
+ */
+typedef mbed_error_t (*u2f2_assets_commit_hook_t)(const u2f2_assets_t *assets);
+
+/*
+ * Fetch the master key material and the rollback counter in one exchange.
+ * Returns MBED_ERROR_NOSTORAGE if the backend has no assets to deliver.
+ */
+mbed_error_t request_assets(int msq, u2f2_assets_t *assets);
+
+/*
+ * Respond to MAGIC_STORAGE_GET_ASSETS_BUNDLE (assets can be NULL if not available)
+ */
+mbed_error_t send_assets(int msq, const u2f2_assets_t *assets);
+
+/*
+ * Update the master key material and the rollback counter, committed at once by the backend.
+ * Returns MBED_ERROR_WRERROR if the backend failed to commit.
+ */
+mbed_error_t update_assets(int msq, const u2f2_assets_t *assets);
+
+/*
+ * Respond to MAGIC_STORAGE_SET_ASSETS, previously received in msgbuf (content of len bytes):
+ * the assets are committed by the hook and the commit status is sent back.
+ */
+mbed_error_t handle_assets_update(int msq, const struct msgbuf *msgbuf, size_t len, u2f2_assets_commit_hook_t hook);
+
+/**** SD rollback counter write-behind */
+
+/*
+ * Rollback counter persistence hook, writing the given value to the SD
+ */
+typedef mbed_error_t (*u2f2_rollbk_persist_hook_t)(uint64_t ctr);
+
+typedef struct {
+    uint64_t ram_ctr;       /* last acknowledged value */
+    uint64_t persisted_ctr; /* last persisted value, always >= ram_ctr */
+    uint32_t pending;       /* increments acknowledged since last persistence */
+    u2f2_rollbk_persist_hook_t persist;
+} u2f2_rollbk_ctx_t;
+
+/*
+ * Initialize the rollback counter write-behind from the value read back from the SD.
+ */
+mbed_error_t u2f2_rollbk_init(u2f2_rollbk_ctx_t *ctx, uint64_t persisted_ctr, u2f2_rollbk_persist_hook_t persist);
+
+/*
+ * Increment the rollback counter. The persistence hook is called only when the reserved
+ * window needs to be moved forward (see CONFIG_USR_LIB_U2F2_ROLLBK_*). On persistence
+ * failure, the counter is not incremented.
+ */
+mbed_error_t u2f2_rollbk_inc(u2f2_rollbk_ctx_t *ctx, uint64_t *value);
+
+/*
+ * Make sure that all the acknowledged values are covered by the persisted counter (e.g. at
+ * shutdown). The persisted counter is written only if it does not cover them yet, without
+ * moving the reserved window forward.
+ */
+mbed_error_t u2f2_rollbk_flush(u2f2_rollbk_ctx_t *ctx);
+
+/*
+ * Respond to MAGIC_STORAGE_ROLLBK_INC and MAGIC_STORAGE_ROLLBK_FLUSH
+ */
+mbed_error_t handle_rollbk_inc(int msq, u2f2_rollbk_ctx_t *ctx);
+
+mbed_error_t handle_rollbk_flush(int msq, u2f2_rollbk_ctx_t *ctx);
+
+/*
+ * Request a rollback counter increment (getting back the new value) or flush to the backend
+ */
+mbed_error_t request_rollbk_inc(int msq, uint64_t *value);
+
+mbed_error_t request_rollbk_flush(int msq);
+
+/**** unlock session */
+
+typedef enum {
+U2F2_UNLOCK_INIT = 0,
+U2F2_UNLOCK_WAIT_PETPIN = 1,
+U2F2_UNLOCK_WAIT_PASSPHRASE = 2,
+U2F2_UNLOCK_WAIT_USERPIN = 3,
+U2F2_UNLOCK_FINALIZE = 4,
+U2F2_UNLOCK_DONE = 5,
+U2F2_UNLOCK_FAILED = 6,
+} u2f2_unlock_state_t;
+
+/*
+ * PET PIN hook: check the received PET PIN (data, of len bytes), set the passphrase to be
+ * confirmed by the user (passphrase_len is the passphrase buffer size on input), and
+ * prepare the key derivation.
+ */
+typedef mbed_error_t (*u2f2_unlock_petpin_hook_t)(const uint8_t *data, size_t len, uint8_t *passphrase, size_t *passphrase_len);
+
+/*
+ * Key derivation step hook, executed while waiting for the user. Returns MBED_ERROR_BUSY
+ * while derivation work remains, MBED_ERROR_NONE once done.
+ */
+typedef mbed_error_t (*u2f2_unlock_derive_step_hook_t)(void);
+
+/*
+ * User PIN hook: check the received user PIN (data, of len bytes) and finish the unlock,
+ * executed once the key derivation is done.
+ */
+typedef mbed_error_t (*u2f2_unlock_userpin_hook_t)(const uint8_t *data, size_t len);
+
+typedef struct {
+    u2f2_unlock_petpin_hook_t      petpin;
+    u2f2_unlock_derive_step_hook_t derive_step;
+    u2f2_unlock_userpin_hook_t     userpin;
+} u2f2_unlock_hooks_t;
+
+typedef struct {
+    int                 msq;
+    u2f2_unlock_state_t state;
+    u2f2_unlock_hooks_t hooks;
+    bool                derive_started;
+    bool                derive_done;
+    uint8_t             userpin[sizeof(msg_mtext_union_t)]; /* user PIN, held until derivation is done */
+    size_t              userpin_len;
+} u2f2_unlock_ctx_t;
+
+/*
+ * Initialize an unlock session with the user side (PIN/UI task) through msq
+ */
+mbed_error_t u2f2_unlock_init(u2f2_unlock_ctx_t *ctx, int msq, const u2f2_unlock_hooks_t *hooks);
+
+/*
+ * Execute one step of the unlock session: handle the next user side message if any
+ * (waiting for it if blocking), or else execute a key derivation step.
+ * On failure, the session state is U2F2_UNLOCK_FAILED.
+ */
+mbed_error_t u2f2_unlock_step(u2f2_unlock_ctx_t *ctx, bool blocking);
+
+/*
+ * Execute the unlock session up to U2F2_UNLOCK_DONE or U2F2_UNLOCK_FAILED.
+ */
+mbed_error_t u2f2_unlock_run(u2f2_unlock_ctx_t *ctx);
+
+/**** IPC trace capture */
+
+#if CONFIG_USR_LIB_U2F2_TRACE
+
+typedef enum {
+U2F2_TRACE_TX = 0,
+U2F2_TRACE_RX = 1,
+} u2f2_trace_dir_t;
+
+typedef struct {
+    uint64_t timestamp; /* in microseconds */
+    uint32_t mtype;
+    uint32_t hash;      /* FNV-1a hash of the message content */
+    int      msq;
+    uint8_t  len;
+    uint8_t  dir;       /* u2f2_trace_dir_t */
+} u2f2_trace_record_t;
+
+/*
+ * Start/stop recording the IPC emitted and received by the helpers.
+ * The trace ring is global to the task and locked, so that sessions handled in different
+ * threads can be recorded at once. The helpers must not be called from ISR handlers.
+ */
+void u2f2_trace_start(void);
+
+void u2f2_trace_stop(void);
+
+/*
+ * Forget all the previous records
+ */
+void u2f2_trace_reset(void);
+
+/*
+ * Number of records available (at most CONFIG_USR_LIB_U2F2_TRACE_DEPTH)
+ */
+uint32_t u2f2_trace_count(void);
+
+/*
+ * Get back a record, index 0 being the oldest available one
+ */
+mbed_error_t u2f2_trace_get(uint32_t index, u2f2_trace_record_t *record);
+
+/*
+ * Print the available records, oldest first, one line each:
+ * "[u2f2-trace] <timestamp> <T|R> <msq> <mtype> <len> <hash>" (timestamp, mtype and hash
+ * in hex). The console log of a session can then be replayed on host (see host/u2f2_replay.c).
+ */
+void u2f2_trace_dump(void);
+
+#endif
 
 #endif/*!LIBU2F2_H_*/
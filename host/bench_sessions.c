@@ -0,0 +1,321 @@
+/*
+ *
+ * Copyright 2019 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * the Free Software Foundation; either version 3 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+/*
+ * Threaded N-session benchmark: N storage backends and N requesters, each pair on its
+ * own link, all running concurrently against the same (in-memory) storage. Each requester
+ * cycles through metadata requests (with icon), 4-candidates lookups and new slots set
+ * from template (each time for another appid, checked with a lookup then deleted),
+ * checking the received content.
+ *
+ * usage: bench_sessions [max_sessions] [requests]
+ */
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "api/libu2f2.h"
+#include "libc/syscall.h"
+#include "libc/stdio.h"
+#include "libc/string.h"
+#include "host.h"
+
+/* harness-local, stops a backend */
+#define BENCH_MAGIC_QUIT    0x4b1dUL
+/* harness-local, deletes the (appid, kh) slot */
+#define BENCH_MAGIC_DELETE  0x4b1eUL
+
+#define BENCH_APPIDS        16
+#define BENCH_ICON_LEN      512
+#define BENCH_CANDIDATES    4
+#define BENCH_MAX_SESSIONS  16
+
+typedef struct {
+    pthread_t thread;
+    int       msq;
+    uint8_t   index;
+    uint32_t  requests;
+    uint32_t  failures;
+} bench_peer_t;
+
+static void bench_appid(uint8_t *appid, uint8_t idx)
+{
+    memset(appid, 0xa0 + idx, 32);
+}
+
+static void bench_kh(uint8_t *kh, uint8_t idx)
+{
+    memset(kh, 0x10 + idx, 32);
+}
+
+static uint8_t bench_icon_byte(uint8_t idx, uint16_t offset)
+{
+    return (uint8_t)(idx * 31 + offset);
+}
+
+static void bench_populate(void)
+{
+    fidostorage_appid_slot_t slot;
+    uint32_t slotid;
+
+    host_storage_reset();
+    for (uint8_t i = 0; i < BENCH_APPIDS; ++i) {
+        memset(&slot, 0x0, sizeof(slot));
+        bench_appid(slot.appid, i);
+        bench_kh(slot.kh, i);
+        snprintf((char*)slot.name, sizeof(slot.name), "bench appid %d", i);
+        slot.ctr = 1000 + i;
+        slot.flags = i;
+        slot.icon_type = ICON_TYPE_IMAGE;
+        slot.icon_len = BENCH_ICON_LEN;
+        for (uint16_t j = 0; j < BENCH_ICON_LEN; ++j) {
+            slot.icon.icon_data[j] = bench_icon_byte(i, j);
+        }
+        slotid = 0;
+        fidostorage_set_appid_metadata(&slotid, &slot, false);
+    }
+}
+
+static void *bench_backend(void *arg)
+{
+    bench_peer_t *peer = arg;
+    u2f2_storage_session_t session;
+    u2f2_slot_cache_t cache; /* per session: the slot cache is not locked */
+    fidostorage_appid_slot_t slot;
+    struct msgbuf msgbuf;
+    uint8_t appid[32];
+    uint8_t kh[32];
+    uint32_t slotid;
+    ssize_t len;
+
+    u2f2_storage_session_init(&session, peer->msq, NULL, 0);
+    u2f2_slot_cache_init(&cache);
+    u2f2_storage_session_set_slot_cache(&session, &cache);
+    for (;;) {
+        if ((len = msgrcv(peer->msq, &msgbuf, sizeof(msg_mtext_union_t), 0, 0)) == -1) {
+            peer->failures++;
+            break;
+        }
+        if (msgbuf.mtype == BENCH_MAGIC_QUIT) {
+            break;
+        }
+        peer->requests++;
+        switch (msgbuf.mtype) {
+            case MAGIC_STORAGE_GET_METADATA:
+                memcpy(appid, &msgbuf.mtext.u8[0], 32);
+                memset(kh, 0x0, 32);
+                if (fidostorage_get_appid_slot(appid, kh, &slotid, NULL, NULL, false) == MBED_ERROR_NONE &&
+                    fidostorage_get_appid_metadata(appid, kh, slotid, NULL, &slot) == MBED_ERROR_NONE) {
+                    if (send_appid_metadata_r(&session, appid, &slot, slot.icon.icon_data) != MBED_ERROR_NONE) {
+                        peer->failures++;
+                    }
+                } else if (send_appid_metadata_r(&session, appid, NULL, NULL) != MBED_ERROR_NONE) {
+                    peer->failures++;
+                }
+                break;
+            case MAGIC_STORAGE_SET_METADATA:
+                if (set_appid_metadata_r(&session, msgbuf.mtext.u8[0], (uint8_t*)&slot, sizeof(slot)) != MBED_ERROR_NONE) {
+                    peer->failures++;
+                }
+                break;
+            case BENCH_MAGIC_DELETE:
+                memcpy(appid, &msgbuf.mtext.u8[0], 32);
+                memcpy(kh, &msgbuf.mtext.u8[32], 32);
+                if (fidostorage_get_appid_slot(appid, kh, &slotid, NULL, NULL, false) != MBED_ERROR_NONE ||
+                    fidostorage_set_appid_metadata(&slotid, &slot, true) != MBED_ERROR_NONE) {
+                    peer->failures++;
+                }
+                break;
+            case MAGIC_STORAGE_LOOKUP_METADATA:
+                if (handle_appid_lookup_r(&session, &msgbuf, len, (uint8_t*)&slot, sizeof(slot)) != MBED_ERROR_NONE) {
+                    peer->failures++;
+                }
+                break;
+            default:
+                peer->failures++;
+                break;
+        }
+    }
+    return NULL;
+}
+
+static bool bench_check(const fidostorage_appid_slot_t *info, const uint8_t *icon, uint8_t idx, uint32_t ctr)
+{
+    if (info->ctr != ctr || icon == NULL || info->icon_len != BENCH_ICON_LEN) {
+        return false;
+    }
+    for (uint16_t j = 0; j < BENCH_ICON_LEN; ++j) {
+        if (icon[j] != bench_icon_byte(idx, j)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Set a new (appid, kh) slot from the template of appid idx, with another ctr, the other
+ * fields (icon included) being kept from the template. The set stream has no response.
+ */
+static bool bench_set_template(int msq, uint8_t idx, const uint8_t *kh, uint32_t ctr)
+{
+    struct msgbuf msgbuf = { 0 };
+
+    msgbuf.mtype = MAGIC_STORAGE_SET_METADATA;
+    msgbuf.mtext.u8[0] = STORAGE_MODE_NEW_FROM_TEMPLATE;
+    if (msgsnd(msq, &msgbuf, 1, 0) == -1) {
+        return false;
+    }
+    msgbuf.mtype = MAGIC_APPID_METADATA_IDENTIFIERS;
+    bench_appid(&msgbuf.mtext.u8[0], idx);
+    memcpy(&msgbuf.mtext.u8[32], kh, 32);
+    if (msgsnd(msq, &msgbuf, 64, 0) == -1) {
+        return false;
+    }
+    msgbuf.mtype = MAGIC_APPID_METADATA_CTR;
+    msgbuf.mtext.u32[0] = ctr;
+    if (msgsnd(msq, &msgbuf, 4, 0) == -1) {
+        return false;
+    }
+    msgbuf.mtype = MAGIC_APPID_METADATA_END;
+    return msgsnd(msq, &msgbuf, 0, 0) != -1;
+}
+
+static void *bench_requester(void *arg)
+{
+    bench_peer_t *peer = arg;
+    u2f2_storage_session_t session;
+    fidostorage_appid_slot_t info;
+    u2f2_lookup_candidate_t candidates[BENCH_CANDIDATES];
+    u2f2_lookup_result_t results[BENCH_CANDIDATES];
+    uint8_t appids[BENCH_CANDIDATES][32];
+    uint8_t khs[BENCH_CANDIDATES][32];
+    uint8_t icon_buf[BENCH_ICON_LEN];
+    uint8_t *icon;
+    uint8_t selected;
+    struct msgbuf msgbuf = { 0 };
+
+    u2f2_storage_session_init(&session, peer->msq, icon_buf, sizeof(icon_buf));
+    for (uint32_t r = 0; r < peer->requests; ++r) {
+        uint8_t idx = (uint8_t)((r / 3) % BENCH_APPIDS);
+        memset(&info, 0x0, sizeof(info));
+        icon = NULL;
+        if ((r % 3) == 0) {
+            bench_appid(appids[0], idx);
+            if (request_appid_metada_r(&session, appids[0], &info, &icon) != MBED_ERROR_NONE ||
+                !bench_check(&info, icon, idx, 1000U + idx)) {
+                peer->failures++;
+            }
+            continue;
+        }
+        if ((r % 3) == 2) {
+            /* a kh of its own for each requester, the new slot being deleted once checked */
+            uint32_t ctr = 5000 + r;
+            bench_appid(appids[0], idx);
+            bench_kh(khs[0], (uint8_t)(0x50 + peer->index));
+            candidates[0].appid = appids[0];
+            candidates[0].kh = khs[0];
+            if (!bench_set_template(peer->msq, idx, khs[0], ctr) ||
+                request_appid_lookup_r(&session, candidates, 1, results, &selected, &info, &icon) != MBED_ERROR_NONE ||
+                selected != 0 || !bench_check(&info, icon, idx, ctr)) {
+                peer->failures++;
+            }
+            memcpy(&msgbuf.mtext.u8[0], appids[0], 32);
+            memcpy(&msgbuf.mtext.u8[32], khs[0], 32);
+            msgbuf.mtype = BENCH_MAGIC_DELETE;
+            msgsnd(peer->msq, &msgbuf, 64, 0);
+            continue;
+        }
+        /* the last candidate only exists, the others having an unknown kh */
+        for (uint8_t i = 0; i < BENCH_CANDIDATES; ++i) {
+            bench_appid(appids[i], idx);
+            bench_kh(khs[i], (i == BENCH_CANDIDATES - 1) ? idx : (uint8_t)(0x80 + i));
+            candidates[i].appid = appids[i];
+            candidates[i].kh = khs[i];
+        }
+        if (request_appid_lookup_r(&session, candidates, BENCH_CANDIDATES, results, &selected, &info, &icon) != MBED_ERROR_NONE ||
+            selected != BENCH_CANDIDATES - 1 || results[0].exists ||
+            !bench_check(&info, icon, idx, 1000U + idx)) {
+            peer->failures++;
+        }
+    }
+    msgbuf.mtype = BENCH_MAGIC_QUIT;
+    msgsnd(peer->msq, &msgbuf, 0, 0);
+    return NULL;
+}
+
+/* run n concurrent sessions, returns the elapsed time in microseconds */
+static uint64_t bench_run(uint8_t n, uint32_t requests, uint32_t *failures)
+{
+    bench_peer_t backends[BENCH_MAX_SESSIONS] = { 0 };
+    bench_peer_t requesters[BENCH_MAX_SESSIONS] = { 0 };
+    uint64_t start = 0, end = 0;
+
+    host_ipc_reset();
+    for (uint8_t i = 0; i < n; ++i) {
+        host_ipc_link(&requesters[i].msq, &backends[i].msq);
+        requesters[i].requests = requests;
+        requesters[i].index = i;
+    }
+    sys_get_systick(&start, PREC_MICRO);
+    for (uint8_t i = 0; i < n; ++i) {
+        pthread_create(&backends[i].thread, NULL, bench_backend, &backends[i]);
+        pthread_create(&requesters[i].thread, NULL, bench_requester, &requesters[i]);
+    }
+    for (uint8_t i = 0; i < n; ++i) {
+        pthread_join(requesters[i].thread, NULL);
+        pthread_join(backends[i].thread, NULL);
+        *failures += requesters[i].failures + backends[i].failures;
+    }
+    sys_get_systick(&end, PREC_MICRO);
+    return end - start;
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t max_sessions = (argc > 1) ? strtoul(argv[1], NULL, 0) : 8;
+    uint32_t requests = (argc > 2) ? strtoul(argv[2], NULL, 0) : 2000;
+    double base_rate = 0;
+    uint32_t failures = 0;
+
+    if (max_sessions == 0 || max_sessions > BENCH_MAX_SESSIONS || requests == 0) {
+        fprintf(stderr, "usage: %s [max_sessions (1-%d)] [requests]\n", argv[0], BENCH_MAX_SESSIONS);
+        return 2;
+    }
+    /* a protocol error fails the request instead of hanging the benchmark */
+    host_ipc_set_timeout(2000);
+    bench_populate();
+    printf("%8s %10s %12s %10s %8s\n", "sessions", "requests", "elapsed(us)", "req/s", "speedup");
+    for (uint32_t n = 1; n <= max_sessions; n *= 2) {
+        uint64_t elapsed = bench_run(n, requests, &failures);
+        double rate = (elapsed != 0) ? (double)n * requests * 1000000.0 / (double)elapsed : 0;
+        if (n == 1) {
+            base_rate = rate;
+        }
+        printf("%8u %10u %12llu %10.0f %7.2fx\n", n, n * requests, (unsigned long long)elapsed,
+               rate, (base_rate != 0) ? rate / base_rate : 0);
+    }
+    if (failures != 0) {
+        printf("%u failure(s)\n", failures);
+        return 1;
+    }
+    return 0;
+}
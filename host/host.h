@@ -0,0 +1,64 @@
+/*
+ *
+ * Copyright 2019 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * the Free Software Foundation; either version 3 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+/*
+ * Host (Linux) harness of the library: stand-in message queues, storage and syscalls,
+ * all thread-safe, so that several sessions can be run concurrently.
+ */
+#ifndef HOST_H_
+#define HOST_H_
+
+#include "libc/types.h"
+
+/*
+ * Create a bidirectional link between two peers. Each peer gets back its own queue id,
+ * msgsnd() on it reaching the other peer, msgrcv() on it receiving from the other peer,
+ * as with the EwoK message queues. Each direction holds up to 8 messages,
+ * msgsnd() blocking when full.
+ * Returns -1 if no more link can be created.
+ */
+int host_ipc_link(int *qid_a, int *qid_b);
+
+/*
+ * Blocking msgsnd()/msgrcv() fail with ETIMEDOUT after timeout_ms (0: never), so that a
+ * protocol error is reported instead of hanging the harness.
+ */
+void host_ipc_set_timeout(uint32_t timeout_ms);
+
+/*
+ * Number of messages sent from and received on a queue id since its link creation.
+ * Returns -1 if the queue id is invalid.
+ */
+int host_ipc_stats(int qid, uint32_t *sent, uint32_t *received);
+
+/*
+ * Drop all the links and their pending messages
+ */
+void host_ipc_reset(void);
+
+/*
+ * Drop all the storage slots
+ */
+void host_storage_reset(void);
+
+#endif/*!HOST_H_*/
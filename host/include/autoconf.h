@@ -0,0 +1,48 @@
+/*
+ *
+ * Copyright 2019 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * the Free Software Foundation; either version 3 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+/*
+ * Host build configuration, mirroring the Kconfig defaults of the library.
+ * The IPC trace capture is enabled, for the replayer.
+ */
+#ifndef HOST_AUTOCONF_H_
+#define HOST_AUTOCONF_H_
+
+#define CONFIG_USR_LIB_U2F2 1
+#define CONFIG_USR_LIB_U2F2_DEBUG 0
+#define CONFIG_USR_LIB_U2F2_TRACE 1
+#define CONFIG_USR_LIB_U2F2_TRACE_DEPTH 4096
+#define CONFIG_USR_LIB_U2F2_READY_POLL_PERIOD 5
+#define CONFIG_USR_LIB_U2F2_PRIO_MAX_HIGH_IN_ROW 8
+#define CONFIG_USR_LIB_U2F2_PRIO_DEFERRED_DEPTH 2
+#define CONFIG_USR_LIB_U2F2_METADATA_NAME 1
+#define CONFIG_USR_LIB_U2F2_METADATA_FLAGS 1
+#define CONFIG_USR_LIB_U2F2_ICON_COLOR 1
+#define CONFIG_USR_LIB_U2F2_ICON_IMAGE 1
+#define CONFIG_USR_LIB_U2F2_SLOT_CACHE_SIZE 8
+#define CONFIG_USR_LIB_U2F2_RESYNC_MAX_MSGS 64
+#define CONFIG_USR_LIB_U2F2_DEAD_STREAMS 4
+#define CONFIG_USR_LIB_U2F2_ROLLBK_PERSIST_PERIOD 16
+#define CONFIG_USR_LIB_U2F2_ROLLBK_RESERVED_WINDOW 16
+
+#endif/*!HOST_AUTOCONF_H_*/
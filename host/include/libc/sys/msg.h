@@ -0,0 +1,51 @@
+/*
+ *
+ * Copyright 2019 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * the Free Software Foundation; either version 3 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+/*
+ * Host stand-in of the EwoK System V-like message queues (see host/stubs/host_ipc.c)
+ */
+#ifndef HOST_LIBC_SYS_MSG_H_
+#define HOST_LIBC_SYS_MSG_H_
+
+#include "libc/types.h"
+
+#define IPC_NOWAIT 04000
+
+typedef union {
+    char     c[64];
+    uint8_t  u8[64];
+    uint16_t u16[32];
+    uint32_t u32[16];
+    uint64_t u64[8];
+} msg_mtext_union_t;
+
+struct msgbuf {
+    long              mtype;
+    msg_mtext_union_t mtext;
+};
+
+int msgsnd(int msqid, const void *msgp, size_t msgsz, int msgflg);
+
+ssize_t msgrcv(int msqid, void *msgp, size_t msgsz, long msgtyp, int msgflg);
+
+#endif/*!HOST_LIBC_SYS_MSG_H_*/
@@ -0,0 +1,56 @@
+/*
+ *
+ * Copyright 2019 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * the Free Software Foundation; either version 3 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+/*
+ * Host stand-in of the EwoK syscalls used by the library
+ */
+#ifndef HOST_LIBC_SYSCALL_H_
+#define HOST_LIBC_SYSCALL_H_
+
+#include "libc/types.h"
+
+typedef enum {
+    SYS_E_DONE = 0,
+    SYS_E_INVAL,
+    SYS_E_DENIED,
+    SYS_E_BUSY,
+} e_syscall_ret;
+
+typedef enum {
+    PREC_MILLI,
+    PREC_MICRO,
+    PREC_CYCLE,
+} e_tick_type;
+
+typedef enum {
+    SLEEP_MODE_INTERRUPTIBLE,
+    SLEEP_MODE_DEEP,
+} sleep_mode_t;
+
+e_syscall_ret sys_get_systick(uint64_t *val, e_tick_type mode);
+
+e_syscall_ret sys_sleep(uint32_t time, sleep_mode_t mode);
+
+e_syscall_ret sys_yield(void);
+
+#endif/*!HOST_LIBC_SYSCALL_H_*/
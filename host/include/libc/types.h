@@ -0,0 +1,63 @@
+/*
+ *
+ * Copyright 2019 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * the Free Software Foundation; either version 3 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+/*
+ * Host stand-in of the EwoK libc types
+ */
+#ifndef HOST_LIBC_TYPES_H_
+#define HOST_LIBC_TYPES_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+typedef uintptr_t physaddr_t;
+
+#define __in
+#define __out
+
+#define likely(x)   __builtin_expect(!!(x), 1)
+#define unlikely(x) __builtin_expect(!!(x), 0)
+
+typedef enum {
+    MBED_ERROR_NONE = 0,
+    MBED_ERROR_NOMEM,
+    MBED_ERROR_NOSTORAGE,
+    MBED_ERROR_NOBACKEND,
+    MBED_ERROR_INVCREDENCIALS,
+    MBED_ERROR_UNSUPORTED_CMD,
+    MBED_ERROR_INVSTATE,
+    MBED_ERROR_NOTREADY,
+    MBED_ERROR_BUSY,
+    MBED_ERROR_DENIED,
+    MBED_ERROR_UNKNOWN,
+    MBED_ERROR_INVPARAM,
+    MBED_ERROR_WRERROR,
+    MBED_ERROR_RDERROR,
+    MBED_ERROR_INITFAIL,
+    MBED_ERROR_TOOBIG,
+    MBED_ERROR_NOTFOUND,
+} mbed_error_t;
+
+#endif/*!HOST_LIBC_TYPES_H_*/
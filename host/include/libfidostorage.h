@@ -0,0 +1,66 @@
+/*
+ *
+ * Copyright 2019 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * the Free Software Foundation; either version 3 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+/*
+ * Host stand-in of libfidostorage: slots are kept in memory (see host/stubs/host_storage.c)
+ */
+#ifndef HOST_LIBFIDOSTORAGE_H_
+#define HOST_LIBFIDOSTORAGE_H_
+
+#include "libc/types.h"
+
+#define ICON_TYPE_NONE  0
+#define ICON_TYPE_COLOR 1
+#define ICON_TYPE_IMAGE 2
+
+typedef union {
+    uint8_t rgb_color[3];
+    uint8_t icon_data[2048];
+} fidostorage_icon_data_t;
+
+typedef struct __attribute__((packed)) {
+    uint8_t  appid[32];
+    uint8_t  kh[32];
+    uint8_t  name[60];
+    uint32_t ctr;
+    uint32_t flags;
+    uint16_t icon_len;
+    uint16_t icon_type;
+    fidostorage_icon_data_t icon;
+} fidostorage_appid_slot_t;
+
+mbed_error_t fidostorage_fetch_shadow_bitmap(void);
+
+/*
+ * Check, against the fetched shadow bitmap, that slotid is still allocated to (appid, kh).
+ * The slot itself is not read. Returns MBED_ERROR_NOTFOUND otherwise.
+ */
+mbed_error_t fidostorage_check_appid_slot(const uint8_t *appid, const uint8_t *kh, uint32_t slotid);
+
+mbed_error_t fidostorage_get_appid_slot(uint8_t *appid, uint8_t *kh, uint32_t *slotid, uint8_t *hmac, uint8_t *replay_counter, bool check_header);
+
+mbed_error_t fidostorage_get_appid_metadata(const uint8_t *appid, const uint8_t *kh, const uint32_t slotid, const uint8_t *appid_slot_hmac, fidostorage_appid_slot_t *data_buffer);
+
+mbed_error_t fidostorage_set_appid_metadata(uint32_t *slotid, fidostorage_appid_slot_t const * const metadata, bool remove);
+
+#endif/*!HOST_LIBFIDOSTORAGE_H_*/
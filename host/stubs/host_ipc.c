@@ -0,0 +1,215 @@
+/*
+ *
+ * Copyright 2019 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * the Free Software Foundation; either version 3 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+#include <pthread.h>
+#include <time.h>
+
+#include "libc/sys/msg.h"
+#include "libc/string.h"
+#include "libc/errno.h"
+#include "host.h"
+
+#define HOST_IPC_MAX_LINKS 32
+#define HOST_IPC_DEPTH     8
+
+typedef struct {
+    struct msgbuf msgs[HOST_IPC_DEPTH];
+    size_t        lens[HOST_IPC_DEPTH];
+    uint8_t       num;
+} host_queue_t;
+
+/*
+ * Queue id 2 * link + side: side[i] holds the messages to be received on the queue id of
+ * side i, msgsnd() on it pushing to side[i ^ 1]. Each link has its own lock, so that
+ * concurrent sessions only contend on the storage.
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    host_queue_t    side[2];
+    uint32_t        sent[2];     /* messages sent from queue id of side i */
+    uint32_t        received[2]; /* messages received on queue id of side i */
+} host_link_t;
+
+static host_link_t     host_links[HOST_IPC_MAX_LINKS];
+static volatile int    host_links_num = 0;
+static volatile uint32_t host_timeout_ms = 0;
+static pthread_mutex_t host_ipc_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int host_ipc_link(int *qid_a, int *qid_b)
+{
+    int ret = -1;
+    pthread_mutex_lock(&host_ipc_lock);
+    if (host_links_num < HOST_IPC_MAX_LINKS) {
+        host_link_t *link = &host_links[host_links_num];
+        memset(&link->side, 0x0, sizeof(link->side));
+        memset(&link->sent, 0x0, sizeof(link->sent));
+        memset(&link->received, 0x0, sizeof(link->received));
+        pthread_mutex_init(&link->lock, NULL);
+        pthread_cond_init(&link->cond, NULL);
+        *qid_a = 2 * host_links_num;
+        *qid_b = 2 * host_links_num + 1;
+        host_links_num++;
+        ret = 0;
+    }
+    pthread_mutex_unlock(&host_ipc_lock);
+    return ret;
+}
+
+void host_ipc_set_timeout(uint32_t timeout_ms)
+{
+    host_timeout_ms = timeout_ms;
+}
+
+void host_ipc_reset(void)
+{
+    pthread_mutex_lock(&host_ipc_lock);
+    for (int i = 0; i < host_links_num; ++i) {
+        pthread_mutex_destroy(&host_links[i].lock);
+        pthread_cond_destroy(&host_links[i].cond);
+    }
+    host_links_num = 0;
+    pthread_mutex_unlock(&host_ipc_lock);
+}
+
+static host_link_t *host_ipc_get_link(int msqid)
+{
+    if (msqid < 0 || msqid >= 2 * host_links_num) {
+        return NULL;
+    }
+    return &host_links[msqid / 2];
+}
+
+int host_ipc_stats(int qid, uint32_t *sent, uint32_t *received)
+{
+    host_link_t *link = host_ipc_get_link(qid);
+
+    if (link == NULL || sent == NULL || received == NULL) {
+        return -1;
+    }
+    pthread_mutex_lock(&link->lock);
+    *sent = link->sent[qid & 1];
+    *received = link->received[qid & 1];
+    pthread_mutex_unlock(&link->lock);
+    return 0;
+}
+
+/* wait for a link update, returns false on timeout. Called with the link lock held. */
+static bool host_ipc_wait(host_link_t *link)
+{
+    struct timespec deadline;
+    uint32_t timeout_ms = host_timeout_ms;
+
+    if (timeout_ms == 0) {
+        pthread_cond_wait(&link->cond, &link->lock);
+        return true;
+    }
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+    return pthread_cond_timedwait(&link->cond, &link->lock, &deadline) == 0;
+}
+
+int msgsnd(int msqid, const void *msgp, size_t msgsz, int msgflg)
+{
+    const struct msgbuf *msgbuf = msgp;
+    host_link_t *link = host_ipc_get_link(msqid);
+    int ret = -1;
+
+    if (link == NULL || msgp == NULL || msgsz > sizeof(msg_mtext_union_t)) {
+        errno = EINVAL;
+        return -1;
+    }
+    pthread_mutex_lock(&link->lock);
+    host_queue_t *queue = &link->side[(msqid & 1) ^ 1];
+    while (queue->num == HOST_IPC_DEPTH) {
+        if (msgflg & IPC_NOWAIT) {
+            errno = EAGAIN;
+            goto err;
+        }
+        if (!host_ipc_wait(link)) {
+            errno = ETIMEDOUT;
+            goto err;
+        }
+    }
+    queue->msgs[queue->num].mtype = msgbuf->mtype;
+    memcpy(&queue->msgs[queue->num].mtext, &msgbuf->mtext, msgsz);
+    queue->lens[queue->num] = msgsz;
+    queue->num++;
+    link->sent[msqid & 1]++;
+    pthread_cond_broadcast(&link->cond);
+    ret = 0;
+err:
+    pthread_mutex_unlock(&link->lock);
+    return ret;
+}
+
+ssize_t msgrcv(int msqid, void *msgp, size_t msgsz, long msgtyp, int msgflg)
+{
+    struct msgbuf *msgbuf = msgp;
+    host_link_t *link = host_ipc_get_link(msqid);
+    ssize_t ret = -1;
+
+    if (link == NULL || msgp == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    pthread_mutex_lock(&link->lock);
+    host_queue_t *queue = &link->side[msqid & 1];
+    for (;;) {
+        for (uint8_t i = 0; i < queue->num; ++i) {
+            if (msgtyp != 0 && queue->msgs[i].mtype != msgtyp) {
+                continue;
+            }
+            if (queue->lens[i] > msgsz) {
+                /* the message is left in the queue */
+                errno = E2BIG;
+                goto err;
+            }
+            msgbuf->mtype = queue->msgs[i].mtype;
+            memcpy(&msgbuf->mtext, &queue->msgs[i].mtext, queue->lens[i]);
+            ret = queue->lens[i];
+            memmove(&queue->msgs[i], &queue->msgs[i + 1], (queue->num - i - 1) * sizeof(struct msgbuf));
+            memmove(&queue->lens[i], &queue->lens[i + 1], (queue->num - i - 1) * sizeof(size_t));
+            queue->num--;
+            link->received[msqid & 1]++;
+            pthread_cond_broadcast(&link->cond);
+            goto err;
+        }
+        if (msgflg & IPC_NOWAIT) {
+            errno = ENOMSG;
+            goto err;
+        }
+        if (!host_ipc_wait(link)) {
+            errno = ETIMEDOUT;
+            goto err;
+        }
+    }
+err:
+    pthread_mutex_unlock(&link->lock);
+    return ret;
+}
@@ -0,0 +1,181 @@
+/*
+ *
+ * Copyright 2019 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * the Free Software Foundation; either version 3 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+#include <pthread.h>
+
+#include "libfidostorage.h"
+#include "libc/string.h"
+#include "host.h"
+
+#define HOST_STORAGE_SLOTS 256
+
+/*
+ * In-memory stand-in of the FIDO storage. Slot ids start at 1, 0 asking for a new slot
+ * on fidostorage_set_appid_metadata(). The slot hmac is a hash of the slot content.
+ */
+static struct {
+    fidostorage_appid_slot_t slot;
+    bool                     used;
+} host_slots[HOST_STORAGE_SLOTS];
+
+static pthread_mutex_t host_storage_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void host_slot_hmac(const fidostorage_appid_slot_t *slot, uint8_t *hmac)
+{
+    const uint8_t *data = (const uint8_t*)slot;
+    for (uint8_t i = 0; i < 32; i += sizeof(uint32_t)) {
+        uint32_t hash = 0x811c9dc5UL ^ i;
+        for (size_t j = 0; j < sizeof(fidostorage_appid_slot_t); ++j) {
+            hash ^= data[j];
+            hash *= 0x01000193UL;
+        }
+        memcpy(&hmac[i], &hash, sizeof(uint32_t));
+    }
+}
+
+void host_storage_reset(void)
+{
+    pthread_mutex_lock(&host_storage_lock);
+    memset(host_slots, 0x0, sizeof(host_slots));
+    pthread_mutex_unlock(&host_storage_lock);
+}
+
+mbed_error_t fidostorage_fetch_shadow_bitmap(void)
+{
+    return MBED_ERROR_NONE;
+}
+
+/*
+ * The shadow bitmap being the in-memory slot table, only the slot allocation and its
+ * identifiers are compared (no hmac computed)
+ */
+mbed_error_t fidostorage_check_appid_slot(const uint8_t *appid, const uint8_t *kh, uint32_t slotid)
+{
+    mbed_error_t errcode = MBED_ERROR_NOTFOUND;
+
+    if (appid == NULL || kh == NULL || slotid == 0 || slotid > HOST_STORAGE_SLOTS) {
+        return MBED_ERROR_INVPARAM;
+    }
+    pthread_mutex_lock(&host_storage_lock);
+    if (host_slots[slotid - 1].used &&
+        memcmp(host_slots[slotid - 1].slot.appid, appid, 32) == 0 &&
+        memcmp(host_slots[slotid - 1].slot.kh, kh, 32) == 0) {
+        errcode = MBED_ERROR_NONE;
+    }
+    pthread_mutex_unlock(&host_storage_lock);
+    return errcode;
+}
+
+/*
+ * The slot of (appid, kh). A null kh resolves the first slot of appid, its kh being
+ * returned in kh (template lookup)
+ */
+mbed_error_t fidostorage_get_appid_slot(uint8_t *appid, uint8_t *kh, uint32_t *slotid, uint8_t *hmac, uint8_t *replay_counter, bool check_header)
+{
+    mbed_error_t errcode = MBED_ERROR_NOTFOUND;
+    const uint8_t null_kh[32] = { 0 };
+    bool template = false;
+    int found = -1;
+
+    if (appid == NULL || kh == NULL || slotid == NULL) {
+        return MBED_ERROR_INVPARAM;
+    }
+    template = (memcmp(kh, null_kh, 32) == 0);
+    pthread_mutex_lock(&host_storage_lock);
+    for (int i = 0; i < HOST_STORAGE_SLOTS; ++i) {
+        if (!host_slots[i].used || memcmp(host_slots[i].slot.appid, appid, 32) != 0) {
+            continue;
+        }
+        if (template || memcmp(host_slots[i].slot.kh, kh, 32) == 0) {
+            found = i;
+            break;
+        }
+    }
+    if (found != -1) {
+        memcpy(kh, host_slots[found].slot.kh, 32);
+        if (hmac != NULL) {
+            host_slot_hmac(&host_slots[found].slot, hmac);
+        }
+        *slotid = found + 1;
+        errcode = MBED_ERROR_NONE;
+    }
+    pthread_mutex_unlock(&host_storage_lock);
+    return errcode;
+}
+
+mbed_error_t fidostorage_get_appid_metadata(const uint8_t *appid, const uint8_t *kh, const uint32_t slotid, const uint8_t *appid_slot_hmac, fidostorage_appid_slot_t *data_buffer)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    uint8_t hmac[32];
+
+    if (data_buffer == NULL || slotid == 0 || slotid > HOST_STORAGE_SLOTS) {
+        return MBED_ERROR_INVPARAM;
+    }
+    pthread_mutex_lock(&host_storage_lock);
+    if (!host_slots[slotid - 1].used) {
+        errcode = MBED_ERROR_NOTFOUND;
+        goto err;
+    }
+    if (appid_slot_hmac != NULL) {
+        host_slot_hmac(&host_slots[slotid - 1].slot, hmac);
+        if (memcmp(hmac, appid_slot_hmac, 32) != 0) {
+            errcode = MBED_ERROR_RDERROR;
+            goto err;
+        }
+    }
+    memcpy(data_buffer, &host_slots[slotid - 1].slot, sizeof(fidostorage_appid_slot_t));
+err:
+    pthread_mutex_unlock(&host_storage_lock);
+    return errcode;
+}
+
+mbed_error_t fidostorage_set_appid_metadata(uint32_t *slotid, fidostorage_appid_slot_t const * const metadata, bool remove)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+
+    if (slotid == NULL || metadata == NULL || *slotid > HOST_STORAGE_SLOTS) {
+        return MBED_ERROR_INVPARAM;
+    }
+    pthread_mutex_lock(&host_storage_lock);
+    if (*slotid == 0) {
+        for (uint32_t i = 0; i < HOST_STORAGE_SLOTS; ++i) {
+            if (!host_slots[i].used) {
+                *slotid = i + 1;
+                break;
+            }
+        }
+        if (*slotid == 0) {
+            errcode = MBED_ERROR_NOMEM;
+            goto err;
+        }
+    }
+    if (remove) {
+        host_slots[*slotid - 1].used = false;
+        goto err;
+    }
+    memcpy(&host_slots[*slotid - 1].slot, metadata, sizeof(fidostorage_appid_slot_t));
+    host_slots[*slotid - 1].used = true;
+err:
+    pthread_mutex_unlock(&host_storage_lock);
+    return errcode;
+}
@@ -0,0 +1,85 @@
+/*
+ *
+ * Copyright 2019 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * the Free Software Foundation; either version 3 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+#include <stdlib.h>
+#include <time.h>
+#include <sched.h>
+
+#include "libc/syscall.h"
+#include "libc/malloc.h"
+#include "libc/sanhandlers.h"
+
+e_syscall_ret sys_get_systick(uint64_t *val, e_tick_type mode)
+{
+    struct timespec ts;
+
+    if (val == NULL) {
+        return SYS_E_INVAL;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    switch (mode) {
+        case PREC_MILLI:
+            *val = ((uint64_t)ts.tv_sec * 1000ULL) + ((uint64_t)ts.tv_nsec / 1000000ULL);
+            break;
+        case PREC_MICRO:
+            *val = ((uint64_t)ts.tv_sec * 1000000ULL) + ((uint64_t)ts.tv_nsec / 1000ULL);
+            break;
+        default:
+            *val = ((uint64_t)ts.tv_sec * 1000000000ULL) + (uint64_t)ts.tv_nsec;
+            break;
+    }
+    return SYS_E_DONE;
+}
+
+e_syscall_ret sys_sleep(uint32_t time, sleep_mode_t mode)
+{
+    struct timespec ts = { .tv_sec = time / 1000, .tv_nsec = (long)(time % 1000) * 1000000L };
+    nanosleep(&ts, NULL);
+    return SYS_E_DONE;
+}
+
+e_syscall_ret sys_yield(void)
+{
+    sched_yield();
+    return SYS_E_DONE;
+}
+
+int wmalloc(void **ptr, uint32_t size, int flags)
+{
+    *ptr = malloc(size);
+    return (*ptr == NULL) ? -1 : 0;
+}
+
+int wfree(void **ptr)
+{
+    free(*ptr);
+    *ptr = NULL;
+    return 0;
+}
+
+void handler_sanity_check_with_panic(physaddr_t handler)
+{
+    if (handler == 0) {
+        abort();
+    }
+}
@@ -0,0 +1,685 @@
+/*
+ *
+ * Copyright 2019 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * the Free Software Foundation; either version 3 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+/*
+ * IPC trace replayer. The console log of captured sessions (see u2f2_trace_dump()) is
+ * split, per message queue, into exchanges, which are replayed through the library helpers
+ * against a stand-in peer thread. For each class of exchange, the number of messages and
+ * the latency of the capture are compared with the replay ones.
+ *
+ * The trace only holds the payload hashes: the peer emits synthetic payloads, consistent
+ * with the captured exchange shape (metadata existence, icon type and size, stream tagging,
+ * number of lookup candidates, signal sizes). Exchanges which cannot be rebuilt that way
+ * (e.g. set_appid_metadata() streams, whose sender is not part of the library) are skipped.
+ *
+ * usage: u2f2_replay [-v] [trace.log]  (stdin if no file is given)
+ * Returns 1 if a replayed exchange failed.
+ */
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "api/libu2f2.h"
+#include "libc/syscall.h"
+#include "libc/stdio.h"
+#include "libc/string.h"
+#include "host.h"
+
+#if CONFIG_USR_LIB_U2F2_TRACE
+
+#define REPLAY_TRACE_TAG      "[u2f2-trace]"
+#define REPLAY_TIMEOUT_MS     1000
+#define REPLAY_MAX_CANDIDATES 254
+
+typedef enum {
+    REPLAY_GET = 0,         /* TX GET_METADATA: request_appid_metada_r() */
+    REPLAY_PRESENCE,        /* TX USER_PRESENCE_METADATA_REQ: request_user_presence_with_metadata_r() */
+    REPLAY_LOOKUP,          /* TX LOOKUP_METADATA: request_appid_lookup_r() */
+    REPLAY_SEND_METADATA,   /* TX metadata status: send_appid_metadata_r(), with presence or not */
+    REPLAY_HANDLE_LOOKUP,   /* RX lookup candidate: handle_appid_lookup_r() */
+    REPLAY_EXCHANGE,        /* TX signal, RX response: exchange_data(), send_signal_with_acknowledge() */
+    REPLAY_HANDLE_SIGNAL,   /* RX signal, TX response: handle_signal() */
+    REPLAY_UNSUPPORTED,     /* set_appid_metadata() streams, truncated or unknown exchanges */
+    REPLAY_CLASSES,
+    REPLAY_CONTINUE = REPLAY_CLASSES, /* the record does not start an exchange */
+} replay_class_t;
+
+static const char *replay_class_names[REPLAY_CLASSES] = {
+    "get_metadata",
+    "presence_metadata",
+    "lookup",
+    "send_metadata",
+    "handle_lookup",
+    "exchange_data",
+    "handle_signal",
+    "unsupported",
+};
+
+typedef struct {
+    uint64_t timestamp;
+    uint32_t mtype;
+    uint32_t hash;
+    int      msq;
+    uint32_t len;
+    uint8_t  dir;
+    uint32_t order;  /* position in the log */
+} replay_record_t;
+
+/* captured exchange shape, used to rebuild an equivalent exchange */
+typedef struct {
+    replay_class_t class;
+    bool     tagged;      /* tagged stream */
+    bool     exists;      /* metadata sent after the status */
+    bool     presence;    /* user presence acknowledged */
+    uint16_t icon_type;
+    uint16_t icon_len;
+    uint16_t candidates;
+    uint32_t sig;
+    uint32_t resp;
+    uint32_t sig_len;
+    uint32_t resp_len;
+} replay_shape_t;
+
+typedef struct {
+    uint32_t exchanges;
+    uint32_t skipped;
+    uint32_t failed;
+    uint64_t capt_msgs;
+    uint64_t replay_msgs;
+    uint64_t capt_us;
+    uint64_t replay_us;
+} replay_stats_t;
+
+typedef struct {
+    pthread_t      thread;
+    int            qid;
+    replay_shape_t shape;
+    mbed_error_t   errcode;
+} replay_peer_t;
+
+static bool replay_verbose = false;
+
+/**************************************************************
+ * synthetic content
+ */
+
+static void replay_appid(uint8_t *appid, uint16_t idx)
+{
+    memset(appid, 0xa0 ^ (uint8_t)idx, 32);
+}
+
+static void replay_kh(uint8_t *kh, uint16_t idx)
+{
+    memset(kh, 0x10 + (uint8_t)idx, 32);
+    kh[31] = (uint8_t)(idx >> 8);
+}
+
+/* the slot matching the captured metadata stream of the shape, for candidate idx */
+static void replay_slot(const replay_shape_t *shape, uint16_t idx, fidostorage_appid_slot_t *slot)
+{
+    memset(slot, 0x0, sizeof(fidostorage_appid_slot_t));
+    replay_appid(slot->appid, idx);
+    replay_kh(slot->kh, idx);
+    snprintf((char*)slot->name, sizeof(slot->name), "replayed appid");
+    slot->ctr = 42;
+    slot->flags = 1;
+    slot->icon_type = shape->icon_type;
+    if (shape->icon_type == ICON_TYPE_IMAGE) {
+        slot->icon_len = shape->icon_len;
+        for (uint16_t i = 0; i < shape->icon_len; ++i) {
+            slot->icon.icon_data[i] = (uint8_t)i;
+        }
+    } else if (shape->icon_type == ICON_TYPE_COLOR) {
+        slot->icon.rgb_color[0] = 0xff;
+    }
+}
+
+static mbed_error_t replay_presence_hook(bool *user_present)
+{
+    *user_present = true;
+    return MBED_ERROR_NONE;
+}
+
+/**************************************************************
+ * capture parsing and exchanges split
+ */
+
+static int replay_record_cmp(const void *a, const void *b)
+{
+    const replay_record_t *ra = a;
+    const replay_record_t *rb = b;
+
+    if (ra->msq != rb->msq) {
+        return (ra->msq < rb->msq) ? -1 : 1;
+    }
+    return (ra->order < rb->order) ? -1 : (ra->order > rb->order);
+}
+
+static replay_record_t *replay_parse(FILE *in, uint32_t *num)
+{
+    replay_record_t *records = NULL;
+    uint32_t size = 0;
+    char line[256];
+    char *tag;
+    char dir;
+    unsigned long long ts;
+    unsigned int mtype, len, hash;
+    int msq;
+
+    *num = 0;
+    while (fgets(line, sizeof(line), in) != NULL) {
+        if ((tag = strstr(line, REPLAY_TRACE_TAG)) == NULL) {
+            continue;
+        }
+        if (sscanf(tag + strlen(REPLAY_TRACE_TAG), " %llx %c %d %x %u %x", &ts, &dir, &msq, &mtype, &len, &hash) != 6 ||
+            (dir != 'T' && dir != 'R') || len > sizeof(msg_mtext_union_t)) {
+            fprintf(stderr, "ignoring malformed trace line: %s", line);
+            continue;
+        }
+        if (*num == size) {
+            size = (size == 0) ? 1024 : size * 2;
+            if ((records = realloc(records, size * sizeof(replay_record_t))) == NULL) {
+                fprintf(stderr, "out of memory\n");
+                exit(2);
+            }
+        }
+        records[*num].timestamp = ts;
+        records[*num].dir = (dir == 'T') ? U2F2_TRACE_TX : U2F2_TRACE_RX;
+        records[*num].msq = msq;
+        records[*num].mtype = mtype;
+        records[*num].len = len;
+        records[*num].hash = hash;
+        records[*num].order = *num;
+        (*num)++;
+    }
+    /* exchanges are split per message queue, keeping the capture order */
+    if (*num > 0) {
+        qsort(records, *num, sizeof(replay_record_t), replay_record_cmp);
+    }
+    return records;
+}
+
+static replay_class_t replay_classify(const replay_record_t *rec)
+{
+    uint32_t base = U2F2_STREAM_BASE(rec->mtype);
+    bool stream = U2F2_IS_STREAM_MTYPE(rec->mtype);
+
+    if (rec->mtype == MAGIC_USER_PRESENCE_ACK) {
+        return REPLAY_CONTINUE;
+    }
+    if (rec->dir == U2F2_TRACE_TX) {
+        switch (rec->mtype) {
+            case MAGIC_STORAGE_GET_METADATA:
+                return REPLAY_GET;
+            case MAGIC_USER_PRESENCE_METADATA_REQ:
+                return REPLAY_PRESENCE;
+            case MAGIC_STORAGE_LOOKUP_METADATA:
+                return REPLAY_LOOKUP;
+            default:
+                break;
+        }
+        if (stream) {
+            return (base == MAGIC_APPID_METADATA_STATUS) ? REPLAY_SEND_METADATA : REPLAY_CONTINUE;
+        }
+        return REPLAY_EXCHANGE;
+    }
+    if (stream) {
+        switch (base) {
+            case MAGIC_APPID_METADATA_IDENTIFIERS:
+                return REPLAY_UNSUPPORTED;
+            case MAGIC_APPID_LOOKUP_CANDIDATE:
+                return REPLAY_HANDLE_LOOKUP;
+            default:
+                return REPLAY_CONTINUE;
+        }
+    }
+    return REPLAY_HANDLE_SIGNAL;
+}
+
+/* does rec start a new exchange, the current one being (first, num) */
+static bool replay_starts_exchange(const replay_record_t *first, uint32_t num, const replay_record_t *rec, replay_class_t *class)
+{
+    *class = replay_classify(rec);
+    if (num == 0) {
+        if (*class == REPLAY_CONTINUE) {
+            /* leftover of an exchange started before the capture */
+            *class = REPLAY_UNSUPPORTED;
+        }
+        return true;
+    }
+    if (rec->msq != first->msq) {
+        if (*class == REPLAY_CONTINUE) {
+            *class = REPLAY_UNSUPPORTED;
+        }
+        return true;
+    }
+    replay_class_t cur = replay_classify(first);
+    const replay_record_t *last = &first[num - 1];
+    /* the lookup backend sends its results and the selected metadata while receiving */
+    if (cur == REPLAY_HANDLE_LOOKUP) {
+        if (*class == REPLAY_SEND_METADATA) {
+            return false;
+        }
+        if (*class == REPLAY_HANDLE_LOOKUP &&
+            (U2F2_STREAM_BASE(last->mtype) == MAGIC_APPID_LOOKUP_CANDIDATE || U2F2_STREAM_BASE(last->mtype) == MAGIC_APPID_LOOKUP_RESULT)) {
+            return false;
+        }
+    }
+    /* signal response */
+    if (cur == REPLAY_EXCHANGE && num == 1 && *class == REPLAY_HANDLE_SIGNAL) {
+        return false;
+    }
+    if (cur == REPLAY_HANDLE_SIGNAL && num == 1 && *class == REPLAY_EXCHANGE) {
+        return false;
+    }
+    return *class != REPLAY_CONTINUE;
+}
+
+/* metadata stream content, in the given direction */
+static void replay_shape_metadata(const replay_record_t *recs, uint32_t num, uint8_t dir, replay_shape_t *shape)
+{
+    for (uint32_t i = 0; i < num; ++i) {
+        if (recs[i].dir != dir || !U2F2_IS_STREAM_MTYPE(recs[i].mtype)) {
+            continue;
+        }
+        if (U2F2_STREAM_ID(recs[i].mtype) != 0) {
+            shape->tagged = true;
+        }
+        switch (U2F2_STREAM_BASE(recs[i].mtype)) {
+            case MAGIC_APPID_METADATA_STATUS:
+            case MAGIC_APPID_LOOKUP_CANDIDATE:
+            case MAGIC_APPID_LOOKUP_RESULT:
+                break;
+            case MAGIC_APPID_METADATA_COLOR:
+                shape->exists = true;
+                shape->icon_type = ICON_TYPE_COLOR;
+                break;
+            case MAGIC_APPID_METADATA_ICON:
+                shape->exists = true;
+                shape->icon_type = ICON_TYPE_IMAGE;
+                shape->icon_len += recs[i].len;
+                break;
+            default:
+                shape->exists = true;
+                break;
+        }
+    }
+}
+
+/* rebuild the shape of a captured exchange. Returns false if it cannot be replayed */
+static bool replay_shape(const replay_record_t *recs, uint32_t num, replay_class_t class, replay_shape_t *shape)
+{
+    memset(shape, 0x0, sizeof(replay_shape_t));
+    shape->class = class;
+    for (uint32_t i = 0; i < num; ++i) {
+        if (recs[i].mtype == MAGIC_USER_PRESENCE_ACK) {
+            shape->presence = true;
+        }
+    }
+    switch (class) {
+        case REPLAY_GET:
+        case REPLAY_PRESENCE:
+            replay_shape_metadata(recs, num, U2F2_TRACE_RX, shape);
+            return num >= 2 && (class == REPLAY_GET || shape->presence);
+        case REPLAY_SEND_METADATA:
+            replay_shape_metadata(recs, num, U2F2_TRACE_TX, shape);
+            return true;
+        case REPLAY_LOOKUP:
+        case REPLAY_HANDLE_LOOKUP: {
+            uint8_t cand_dir = (class == REPLAY_LOOKUP) ? U2F2_TRACE_TX : U2F2_TRACE_RX;
+            for (uint32_t i = 0; i < num; ++i) {
+                if (recs[i].dir == cand_dir && U2F2_IS_STREAM_MTYPE(recs[i].mtype) &&
+                    U2F2_STREAM_BASE(recs[i].mtype) == MAGIC_APPID_LOOKUP_CANDIDATE) {
+                    shape->candidates++;
+                }
+            }
+            replay_shape_metadata(recs, num, (class == REPLAY_LOOKUP) ? U2F2_TRACE_RX : U2F2_TRACE_TX, shape);
+            replay_shape_metadata(recs, num, cand_dir, shape);
+            return shape->candidates > 0 && shape->candidates <= REPLAY_MAX_CANDIDATES;
+        }
+        case REPLAY_EXCHANGE:
+        case REPLAY_HANDLE_SIGNAL:
+            if (num != 2) {
+                return false;
+            }
+            shape->sig = recs[0].mtype;
+            shape->sig_len = recs[0].len;
+            shape->resp = recs[1].mtype;
+            shape->resp_len = recs[1].len;
+            /* handle_signal() only handles empty signals */
+            return class == REPLAY_EXCHANGE || (shape->sig_len == 0 && shape->resp_len == 0);
+        default:
+            return false;
+    }
+}
+
+/**************************************************************
+ * stand-in peer
+ */
+
+static void replay_candidates(uint16_t num, uint8_t (*appids)[32], uint8_t (*khs)[32], u2f2_lookup_candidate_t *candidates)
+{
+    for (uint16_t i = 0; i < num; ++i) {
+        replay_appid(appids[i], i);
+        replay_kh(khs[i], i);
+        candidates[i].appid = appids[i];
+        candidates[i].kh = khs[i];
+    }
+}
+
+/* storage content for the lookups: only the last candidate exists, if the capture had a hit */
+static void replay_populate(const replay_shape_t *shape)
+{
+    fidostorage_appid_slot_t slot;
+    uint32_t slotid = 0;
+
+    host_storage_reset();
+    if (shape->exists) {
+        replay_slot(shape, shape->candidates - 1, &slot);
+        fidostorage_set_appid_metadata(&slotid, &slot, false);
+    }
+}
+
+static void *replay_peer(void *arg)
+{
+    replay_peer_t *peer = arg;
+    const replay_shape_t *shape = &peer->shape;
+    u2f2_storage_session_t session;
+    static __thread fidostorage_appid_slot_t slot;
+    static __thread uint8_t appids[REPLAY_MAX_CANDIDATES][32];
+    static __thread uint8_t khs[REPLAY_MAX_CANDIDATES][32];
+    u2f2_lookup_candidate_t candidates[REPLAY_MAX_CANDIDATES];
+    u2f2_lookup_result_t results[REPLAY_MAX_CANDIDATES];
+    struct msgbuf msgbuf = { 0 };
+    uint8_t *icon = NULL;
+    uint8_t selected;
+    bool present;
+    ssize_t len;
+
+    u2f2_storage_session_init(&session, peer->qid, NULL, 0);
+    u2f2_storage_session_set_stream_tagging(&session, shape->tagged);
+    peer->errcode = MBED_ERROR_NONE;
+    switch (shape->class) {
+        case REPLAY_GET:
+        case REPLAY_PRESENCE:
+        case REPLAY_LOOKUP:
+            /* backend side: the request is received by the application */
+            if ((len = msgrcv(peer->qid, &msgbuf, sizeof(msg_mtext_union_t), 0, 0)) == -1) {
+                peer->errcode = MBED_ERROR_UNKNOWN;
+                break;
+            }
+            if (shape->class == REPLAY_LOOKUP) {
+                peer->errcode = handle_appid_lookup_r(&session, &msgbuf, len, (uint8_t*)&slot, sizeof(slot));
+                break;
+            }
+            session.stream_id = u2f2_request_stream_id(&msgbuf, len, 32);
+            replay_slot(shape, 0, &slot);
+            if (shape->class == REPLAY_GET) {
+                peer->errcode = send_appid_metadata_r(&session, &msgbuf.mtext.u8[0], shape->exists ? &slot : NULL, slot.icon.icon_data);
+            } else {
+                peer->errcode = send_appid_metadata_with_presence_r(&session, &msgbuf.mtext.u8[0], shape->exists ? &slot : NULL, slot.icon.icon_data, replay_presence_hook);
+            }
+            break;
+        case REPLAY_SEND_METADATA:
+            /* requester side, its request being left unread by the replayed backend */
+            replay_appid(msgbuf.mtext.u8, 0);
+            memset(&slot, 0x0, sizeof(slot));
+            if (shape->presence) {
+                peer->errcode = request_user_presence_with_metadata_r(&session, msgbuf.mtext.u8, &slot, &icon, &present);
+            } else {
+                peer->errcode = request_appid_metada_r(&session, msgbuf.mtext.u8, &slot, &icon);
+            }
+            if (peer->errcode == MBED_ERROR_NOSTORAGE && !shape->exists) {
+                peer->errcode = MBED_ERROR_NONE;
+            }
+            break;
+        case REPLAY_HANDLE_LOOKUP:
+            replay_candidates(shape->candidates, appids, khs, candidates);
+            memset(&slot, 0x0, sizeof(slot));
+            peer->errcode = request_appid_lookup_r(&session, candidates, shape->candidates, results, &selected, &slot, &icon);
+            if (peer->errcode == MBED_ERROR_NOSTORAGE && !shape->exists) {
+                peer->errcode = MBED_ERROR_NONE;
+            }
+            break;
+        case REPLAY_EXCHANGE:
+            if (msgrcv(peer->qid, &msgbuf, sizeof(msg_mtext_union_t), shape->sig, 0) == -1) {
+                peer->errcode = MBED_ERROR_UNKNOWN;
+                break;
+            }
+            msgbuf.mtype = shape->resp;
+            memset(&msgbuf.mtext, 0x0, sizeof(msg_mtext_union_t));
+            if (msgsnd(peer->qid, &msgbuf, shape->resp_len, 0) == -1) {
+                peer->errcode = MBED_ERROR_UNKNOWN;
+            }
+            break;
+        case REPLAY_HANDLE_SIGNAL:
+            msgbuf.mtype = shape->sig;
+            if (msgsnd(peer->qid, &msgbuf, 0, 0) == -1 ||
+                msgrcv(peer->qid, &msgbuf, 0, shape->resp, 0) == -1) {
+                peer->errcode = MBED_ERROR_UNKNOWN;
+            }
+            break;
+        default:
+            break;
+    }
+    return NULL;
+}
+
+/**************************************************************
+ * replayed exchange, executed by the library helpers
+ */
+
+static mbed_error_t replay_drive(int qid, const replay_shape_t *shape)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    u2f2_storage_session_t session;
+    static uint8_t icon_buf[sizeof(fidostorage_icon_data_t)];
+    static fidostorage_appid_slot_t slot;
+    static uint8_t appids[REPLAY_MAX_CANDIDATES][32];
+    static uint8_t khs[REPLAY_MAX_CANDIDATES][32];
+    u2f2_lookup_candidate_t candidates[REPLAY_MAX_CANDIDATES];
+    u2f2_lookup_result_t results[REPLAY_MAX_CANDIDATES];
+    msg_mtext_union_t data = { 0 };
+    struct msgbuf msgbuf = { 0 };
+    uint8_t appid[32];
+    uint8_t *icon = NULL;
+    uint8_t selected;
+    bool present;
+    size_t len;
+
+    u2f2_storage_session_init(&session, qid, icon_buf, sizeof(icon_buf));
+    u2f2_storage_session_set_stream_tagging(&session, shape->tagged);
+    replay_appid(appid, 0);
+    switch (shape->class) {
+        case REPLAY_GET:
+            errcode = request_appid_metada_r(&session, appid, &slot, &icon);
+            break;
+        case REPLAY_PRESENCE:
+            errcode = request_user_presence_with_metadata_r(&session, appid, &slot, &icon, &present);
+            break;
+        case REPLAY_LOOKUP:
+            replay_candidates(shape->candidates, appids, khs, candidates);
+            errcode = request_appid_lookup_r(&session, candidates, shape->candidates, results, &selected, &slot, &icon);
+            break;
+        case REPLAY_SEND_METADATA:
+            /* the requester stream id, as received in its request */
+            session.stream_id = shape->tagged ? 1 : 0;
+            replay_slot(shape, 0, &slot);
+            if (shape->presence) {
+                errcode = send_appid_metadata_with_presence_r(&session, appid, shape->exists ? &slot : NULL, slot.icon.icon_data, replay_presence_hook);
+            } else {
+                errcode = send_appid_metadata_r(&session, appid, shape->exists ? &slot : NULL, slot.icon.icon_data);
+            }
+            break;
+        case REPLAY_HANDLE_LOOKUP:
+            /* the request, received by the application */
+            msgbuf.mtype = MAGIC_STORAGE_LOOKUP_METADATA;
+            msgbuf.mtext.u8[0] = (uint8_t)shape->candidates;
+            msgbuf.mtext.u8[1] = 1;
+            errcode = handle_appid_lookup_r(&session, &msgbuf, shape->tagged ? 2 : 1, (uint8_t*)&slot, sizeof(slot));
+            break;
+        case REPLAY_EXCHANGE:
+            if (shape->sig_len == 0 && shape->resp_len == 0) {
+                errcode = send_signal_with_acknowledge(qid, shape->sig, shape->resp);
+            } else {
+                len = shape->resp_len;
+                errcode = exchange_data(qid, shape->sig, shape->resp, &data, shape->sig_len, &data, &len);
+            }
+            break;
+        case REPLAY_HANDLE_SIGNAL:
+            errcode = handle_signal(qid, shape->sig, shape->resp, NULL);
+            break;
+        default:
+            errcode = MBED_ERROR_UNSUPORTED_CMD;
+            break;
+    }
+    /* a missing appid is the expected result of a capture without metadata */
+    if (errcode == MBED_ERROR_NOSTORAGE && !shape->exists) {
+        errcode = MBED_ERROR_NONE;
+    }
+    return errcode;
+}
+
+static void replay_exchange(const replay_record_t *recs, uint32_t num, replay_class_t class, replay_stats_t *stats)
+{
+    replay_peer_t peer;
+    replay_shape_t shape;
+    replay_stats_t *cstats = &stats[class];
+    int qid;
+    uint64_t start = 0, end = 0;
+    uint32_t sent = 0, received = 0;
+    mbed_error_t errcode;
+
+    if (class == REPLAY_UNSUPPORTED || !replay_shape(recs, num, class, &shape)) {
+        stats[REPLAY_UNSUPPORTED].skipped++;
+        if (replay_verbose) {
+            printf("msq %d: %s exchange of %u message(s) skipped\n", recs[0].msq, replay_class_names[class], num);
+        }
+        return;
+    }
+    /* a fresh link and storage for each exchange, so that a failure does not impact the next ones */
+    host_ipc_reset();
+    host_ipc_link(&qid, &peer.qid);
+    if (class == REPLAY_HANDLE_LOOKUP || class == REPLAY_LOOKUP) {
+        replay_populate(&shape);
+    }
+    peer.shape = shape;
+    pthread_create(&peer.thread, NULL, replay_peer, &peer);
+    sys_get_systick(&start, PREC_MICRO);
+    errcode = replay_drive(qid, &shape);
+    sys_get_systick(&end, PREC_MICRO);
+    pthread_join(peer.thread, NULL);
+    host_ipc_stats(qid, &sent, &received);
+
+    cstats->exchanges++;
+    cstats->capt_msgs += num;
+    cstats->replay_msgs += sent + received;
+    cstats->capt_us += recs[num - 1].timestamp - recs[0].timestamp;
+    cstats->replay_us += end - start;
+    if (errcode != MBED_ERROR_NONE || peer.errcode != MBED_ERROR_NONE) {
+        cstats->failed++;
+    }
+    if (replay_verbose) {
+        printf("msq %d: %s: %u -> %u message(s), %llu -> %llu us%s\n", recs[0].msq, replay_class_names[class],
+               num, sent + received, (unsigned long long)(recs[num - 1].timestamp - recs[0].timestamp),
+               (unsigned long long)(end - start),
+               (errcode != MBED_ERROR_NONE || peer.errcode != MBED_ERROR_NONE) ? " FAILED" : "");
+    }
+}
+
+static void replay_report_line(const char *name, const replay_stats_t *s)
+{
+    printf("%-18s %9u %7u %6u %10llu %10llu %+7lld %12llu %12llu %+10lld\n", name,
+           s->exchanges, s->skipped, s->failed,
+           (unsigned long long)s->capt_msgs, (unsigned long long)s->replay_msgs,
+           (long long)s->replay_msgs - (long long)s->capt_msgs,
+           (unsigned long long)s->capt_us, (unsigned long long)s->replay_us,
+           (long long)s->replay_us - (long long)s->capt_us);
+}
+
+int main(int argc, char **argv)
+{
+    replay_stats_t stats[REPLAY_CLASSES] = { 0 };
+    replay_stats_t total = { 0 };
+    replay_record_t *records;
+    FILE *in = stdin;
+    uint32_t num = 0;
+    uint32_t first = 0;
+    replay_class_t class = REPLAY_UNSUPPORTED;
+    replay_class_t next;
+    int arg = 1;
+
+    if (arg < argc && strcmp(argv[arg], "-v") == 0) {
+        replay_verbose = true;
+        arg++;
+    }
+    if (arg < argc && (in = fopen(argv[arg], "r")) == NULL) {
+        fprintf(stderr, "usage: %s [-v] [trace.log]\n", argv[0]);
+        return 2;
+    }
+    records = replay_parse(in, &num);
+    /* a peer not following the captured protocol fails the exchange instead of hanging */
+    host_ipc_set_timeout(REPLAY_TIMEOUT_MS);
+    for (uint32_t i = 0; i < num; ++i) {
+        if (replay_starts_exchange(&records[first], i - first, &records[i], &next)) {
+            if (i > first) {
+                replay_exchange(&records[first], i - first, class, stats);
+            }
+            first = i;
+            class = next;
+        }
+    }
+    if (num > first) {
+        replay_exchange(&records[first], num - first, class, stats);
+    }
+    printf("%-18s %9s %7s %6s %10s %10s %7s %12s %12s %10s\n", "exchange", "replayed", "skipped", "failed",
+           "msgs capt", "msgs repl", "delta", "capt (us)", "repl (us)", "delta");
+    for (uint8_t c = 0; c < REPLAY_CLASSES; ++c) {
+        if (stats[c].exchanges == 0 && stats[c].skipped == 0) {
+            continue;
+        }
+        replay_report_line(replay_class_names[c], &stats[c]);
+        total.exchanges += stats[c].exchanges;
+        total.skipped += stats[c].skipped;
+        total.failed += stats[c].failed;
+        if (c != REPLAY_UNSUPPORTED) {
+            total.capt_msgs += stats[c].capt_msgs;
+            total.replay_msgs += stats[c].replay_msgs;
+            total.capt_us += stats[c].capt_us;
+            total.replay_us += stats[c].replay_us;
+        }
+    }
+    replay_report_line("total (replayed)", &total);
+    free(records);
+    return (total.failed != 0) ? 1 : 0;
+}
+
+#else
+
+/* the trace records format is only defined when the capture is enabled */
+int main(int argc, char **argv)
+{
+    fprintf(stderr, "%s: built without CONFIG_USR_LIB_U2F2_TRACE\n", argv[0]);
+    return 2;
+}
+
+#endif
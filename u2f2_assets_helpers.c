@@ -0,0 +1,365 @@
+/*
+ *
+ * Copyright 2019 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * the Free Software Foundation; either version 3 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+#include "api/libu2f2.h"
+#include "libc/string.h"
+#include "libc/stdio.h"
+
+#include "u2f2_helpers.h"
+
+
+/*
+ * Storage assets (master key material and SD rollback counter) are fetched and updated
+ * as a single bundle, in one exchange each:
+ *
+ * <------------ MAGIC_STORAGE_GET_ASSETS_BUNDLE
+ * ------------> MAGIC_STORAGE_ASSETS (u2f2_assets_t, or empty if assets are not available)
+ *
+ * <------------ MAGIC_STORAGE_SET_ASSETS (u2f2_assets_t)
+ * ------------> MAGIC_STORAGE_SET_ASSETS_STATUS (u8: 0xff if committed)
+ */
+
+mbed_error_t request_assets(int msq, u2f2_assets_t *assets)
+{
+    log_printf("%s\n", __func__);
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    struct msgbuf msgbuf = { 0 };
+    ssize_t len;
+
+    if (assets == NULL) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+    msgbuf.mtype = MAGIC_STORAGE_GET_ASSETS_BUNDLE;
+    if (unlikely(u2f2_msgsnd(msq, &msgbuf, 0, 0) == -1)) {
+        log_printf("[u2f2] failure while sending assets request, errno=%d\n", errno);
+        errcode = MBED_ERROR_UNKNOWN;
+        goto err;
+    }
+    if (unlikely((len = u2f2_msgrcv(msq, &msgbuf, sizeof(u2f2_assets_t), MAGIC_STORAGE_ASSETS, 0)) == -1)) {
+        log_printf("[u2f2] failure while receiving assets, errno=%d\n", errno);
+        errcode = MBED_ERROR_UNKNOWN;
+        goto err;
+    }
+    if (len != sizeof(u2f2_assets_t)) {
+        log_printf("[u2f2] assets not available (len %d)\n", (int)len);
+        errcode = MBED_ERROR_NOSTORAGE;
+        goto err;
+    }
+    memcpy(assets, &msgbuf.mtext.u8[0], sizeof(u2f2_assets_t));
+err:
+    /* assets contain key material, not left on the stack */
+    memset(&msgbuf, 0x0, sizeof(struct msgbuf));
+    return errcode;
+}
+
+/*
+ * here, MAGIC_STORAGE_GET_ASSETS_BUNDLE has just been received from msq. responding...
+ * assets can be NULL if they are not available.
+ */
+mbed_error_t send_assets(int msq, const u2f2_assets_t *assets)
+{
+    log_printf("%s\n", __func__);
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    struct msgbuf msgbuf = { 0 };
+    size_t msg_len = 0;
+
+    msgbuf.mtype = MAGIC_STORAGE_ASSETS;
+    if (assets != NULL) {
+        memcpy(&msgbuf.mtext.u8[0], assets, sizeof(u2f2_assets_t));
+        msg_len = sizeof(u2f2_assets_t);
+    }
+    if (unlikely(u2f2_msgsnd(msq, &msgbuf, msg_len, 0) == -1)) {
+        log_printf("[u2f2] failure while sending assets, errno=%d\n", errno);
+        errcode = MBED_ERROR_UNKNOWN;
+    }
+    memset(&msgbuf, 0x0, sizeof(struct msgbuf));
+    return errcode;
+}
+
+mbed_error_t update_assets(int msq, const u2f2_assets_t *assets)
+{
+    log_printf("%s\n", __func__);
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    struct msgbuf msgbuf = { 0 };
+
+    if (assets == NULL) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+    msgbuf.mtype = MAGIC_STORAGE_SET_ASSETS;
+    memcpy(&msgbuf.mtext.u8[0], assets, sizeof(u2f2_assets_t));
+    if (unlikely(u2f2_msgsnd(msq, &msgbuf, sizeof(u2f2_assets_t), 0) == -1)) {
+        log_printf("[u2f2] failure while sending assets update, errno=%d\n", errno);
+        errcode = MBED_ERROR_UNKNOWN;
+        goto err;
+    }
+    /* assets contain key material, not left on the stack */
+    memset(&msgbuf, 0x0, sizeof(struct msgbuf));
+    if (unlikely(u2f2_msgrcv(msq, &msgbuf, 1, MAGIC_STORAGE_SET_ASSETS_STATUS, 0) == -1)) {
+        log_printf("[u2f2] failure while receiving assets update status, errno=%d\n", errno);
+        errcode = MBED_ERROR_UNKNOWN;
+        goto err;
+    }
+    if (msgbuf.mtext.u8[0] != 0xff) {
+        log_printf("[u2f2] assets update not committed by backend\n");
+        errcode = MBED_ERROR_WRERROR;
+        goto err;
+    }
+err:
+    memset(&msgbuf, 0x0, sizeof(struct msgbuf));
+    return errcode;
+}
+
+/*
+ * here, MAGIC_STORAGE_SET_ASSETS has just been received from msq, with msgbuf content of
+ * len bytes. The hook commits the assets bundle, its result is sent back.
+ */
+mbed_error_t handle_assets_update(int msq, const struct msgbuf *msgbuf, size_t len, u2f2_assets_commit_hook_t hook)
+{
+    log_printf("%s\n", __func__);
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    struct msgbuf resp = { 0 };
+    u2f2_assets_t assets;
+
+    if (msgbuf == NULL || hook == NULL) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto send;
+    }
+    if (len != sizeof(u2f2_assets_t)) {
+        log_printf("[u2f2] received assets have invalid size! (%d instead of %d)\n", (int)len, (int)sizeof(u2f2_assets_t));
+        errcode = MBED_ERROR_INVPARAM;
+        goto send;
+    }
+    memcpy(&assets, &msgbuf->mtext.u8[0], sizeof(u2f2_assets_t));
+    handler_sanity_check_with_panic((physaddr_t)hook);
+    errcode = hook(&assets);
+    /* assets contain key material, not left on the stack */
+    memset(&assets, 0x0, sizeof(u2f2_assets_t));
+send:
+    /* the requester is always answered, even on error */
+    resp.mtype = MAGIC_STORAGE_SET_ASSETS_STATUS;
+    resp.mtext.u8[0] = (errcode == MBED_ERROR_NONE) ? 0xff : 0x00;
+    if (unlikely(u2f2_msgsnd(msq, &resp, 1, 0) == -1)) {
+        log_printf("[u2f2] failure while sending assets update status, errno=%d\n", errno);
+        errcode = MBED_ERROR_UNKNOWN;
+    }
+    return errcode;
+}
+
+
+/*
+ * SD rollback counter write-behind.
+ *
+ * Increments are acknowledged from the in-RAM counter. The persisted counter is always
+ * ahead of it, by a reserved window: each persistence writes the in-RAM value plus
+ * CONFIG_USR_LIB_U2F2_ROLLBK_RESERVED_WINDOW, and happens every
+ * CONFIG_USR_LIB_U2F2_ROLLBK_PERSIST_PERIOD increments, or as soon as the in-RAM value
+ * would reach the persisted one. A value acknowledged to a peer is then never above
+ * the persisted counter, and after a reset the counter restarts from the persisted
+ * value, skipping at most the reserved window.
+ *
+ * A flush only writes the persisted counter if it does not cover the acknowledged values
+ * yet, without reserving a new window.
+ *
+ * <------------ MAGIC_STORAGE_ROLLBK_INC
+ * ------------> MAGIC_STORAGE_ROLLBK_INC_ACK (u64: incremented counter, or empty on error)
+ *
+ * <------------ MAGIC_STORAGE_ROLLBK_FLUSH
+ * ------------> MAGIC_STORAGE_ROLLBK_FLUSH_STATUS (u8: 0xff if persisted)
+ */
+
+/*
+ * persist reserve, the value from which the counter restarts after a reset. Nothing is
+ * written if the persisted counter is already at or above it (it never decreases).
+ */
+static mbed_error_t rollbk_persist(u2f2_rollbk_ctx_t *ctx, uint64_t reserve)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+
+    if (reserve <= ctx->persisted_ctr) {
+        ctx->pending = 0;
+        goto err;
+    }
+    handler_sanity_check_with_panic((physaddr_t)ctx->persist);
+    if (unlikely((errcode = ctx->persist(reserve)) != MBED_ERROR_NONE)) {
+        log_printf("[u2f2] failed to persist rollback counter!\n");
+        goto err;
+    }
+    ctx->persisted_ctr = reserve;
+    ctx->pending = 0;
+err:
+    return errcode;
+}
+
+mbed_error_t u2f2_rollbk_init(u2f2_rollbk_ctx_t *ctx, uint64_t persisted_ctr, u2f2_rollbk_persist_hook_t persist)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    if (ctx == NULL || persist == NULL) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+    /* restarting from the persisted value, the previous window is consumed */
+    ctx->ram_ctr = persisted_ctr;
+    ctx->persisted_ctr = persisted_ctr;
+    ctx->pending = 0;
+    ctx->persist = persist;
+err:
+    return errcode;
+}
+
+mbed_error_t u2f2_rollbk_inc(u2f2_rollbk_ctx_t *ctx, uint64_t *value)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    if (ctx == NULL || value == NULL || ctx->persist == NULL) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+    uint64_t next = ctx->ram_ctr + 1;
+    if (next > ctx->persisted_ctr || (ctx->pending + 1) >= CONFIG_USR_LIB_U2F2_ROLLBK_PERSIST_PERIOD) {
+        /* persist before acknowledging, reserving the next window */
+        if (unlikely((errcode = rollbk_persist(ctx, next + CONFIG_USR_LIB_U2F2_ROLLBK_RESERVED_WINDOW)) != MBED_ERROR_NONE)) {
+            goto err;
+        }
+    } else {
+        ctx->pending++;
+    }
+    ctx->ram_ctr = next;
+    *value = next;
+err:
+    return errcode;
+}
+
+mbed_error_t u2f2_rollbk_flush(u2f2_rollbk_ctx_t *ctx)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    if (ctx == NULL || ctx->persist == NULL) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+    if (ctx->pending == 0) {
+        /* nothing acknowledged since last persistence */
+        goto err;
+    }
+    /* only the acknowledged values are to be covered */
+    errcode = rollbk_persist(ctx, ctx->ram_ctr);
+err:
+    return errcode;
+}
+
+/*
+ * here, MAGIC_STORAGE_ROLLBK_INC has just been received from msq. responding...
+ */
+mbed_error_t handle_rollbk_inc(int msq, u2f2_rollbk_ctx_t *ctx)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    struct msgbuf msgbuf = { 0 };
+    size_t msg_len = 0;
+    uint64_t value = 0;
+
+    errcode = u2f2_rollbk_inc(ctx, &value);
+    msgbuf.mtype = MAGIC_STORAGE_ROLLBK_INC_ACK;
+    if (errcode == MBED_ERROR_NONE) {
+        msgbuf.mtext.u64[0] = value;
+        msg_len = sizeof(uint64_t);
+    }
+    if (unlikely(u2f2_msgsnd(msq, &msgbuf, msg_len, 0) == -1)) {
+        log_printf("[u2f2] failure while sending rollback counter, errno=%d\n", errno);
+        errcode = MBED_ERROR_UNKNOWN;
+    }
+    return errcode;
+}
+
+/*
+ * here, MAGIC_STORAGE_ROLLBK_FLUSH has just been received from msq. responding...
+ */
+mbed_error_t handle_rollbk_flush(int msq, u2f2_rollbk_ctx_t *ctx)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    struct msgbuf msgbuf = { 0 };
+
+    errcode = u2f2_rollbk_flush(ctx);
+    msgbuf.mtype = MAGIC_STORAGE_ROLLBK_FLUSH_STATUS;
+    msgbuf.mtext.u8[0] = (errcode == MBED_ERROR_NONE) ? 0xff : 0x00;
+    if (unlikely(u2f2_msgsnd(msq, &msgbuf, 1, 0) == -1)) {
+        log_printf("[u2f2] failure while sending rollback flush status, errno=%d\n", errno);
+        errcode = MBED_ERROR_UNKNOWN;
+    }
+    return errcode;
+}
+
+mbed_error_t request_rollbk_inc(int msq, uint64_t *value)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    struct msgbuf msgbuf = { 0 };
+    ssize_t len;
+
+    if (value == NULL) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+    msgbuf.mtype = MAGIC_STORAGE_ROLLBK_INC;
+    if (unlikely(u2f2_msgsnd(msq, &msgbuf, 0, 0) == -1)) {
+        log_printf("[u2f2] failure while sending rollback increment, errno=%d\n", errno);
+        errcode = MBED_ERROR_UNKNOWN;
+        goto err;
+    }
+    if (unlikely((len = u2f2_msgrcv(msq, &msgbuf, sizeof(uint64_t), MAGIC_STORAGE_ROLLBK_INC_ACK, 0)) == -1)) {
+        log_printf("[u2f2] failure while receiving rollback counter, errno=%d\n", errno);
+        errcode = MBED_ERROR_UNKNOWN;
+        goto err;
+    }
+    if (len != sizeof(uint64_t)) {
+        log_printf("[u2f2] rollback counter increment refused by backend\n");
+        errcode = MBED_ERROR_WRERROR;
+        goto err;
+    }
+    *value = msgbuf.mtext.u64[0];
+err:
+    return errcode;
+}
+
+mbed_error_t request_rollbk_flush(int msq)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    struct msgbuf msgbuf = { 0 };
+    ssize_t len;
+
+    msgbuf.mtype = MAGIC_STORAGE_ROLLBK_FLUSH;
+    if (unlikely(u2f2_msgsnd(msq, &msgbuf, 0, 0) == -1)) {
+        log_printf("[u2f2] failure while sending rollback flush, errno=%d\n", errno);
+        errcode = MBED_ERROR_UNKNOWN;
+        goto err;
+    }
+    if (unlikely((len = u2f2_msgrcv(msq, &msgbuf, 1, MAGIC_STORAGE_ROLLBK_FLUSH_STATUS, 0)) == -1)) {
+        log_printf("[u2f2] failure while receiving rollback flush status, errno=%d\n", errno);
+        errcode = MBED_ERROR_UNKNOWN;
+        goto err;
+    }
+    if (len != 1 || msgbuf.mtext.u8[0] != 0xff) {
+        errcode = MBED_ERROR_WRERROR;
+        goto err;
+    }
+err:
+    return errcode;
+}
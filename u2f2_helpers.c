@@ -24,12 +24,9 @@
 #include "api/libu2f2.h"
 #include "libc/string.h"
 #include "libc/stdio.h"
+#include "libc/syscall.h"
 
-#if CONFIG_USR_LIB_U2F2_DEBUG
-# define log_printf(...) printf(__VA_ARGS__)
-#else
-# define log_printf(...)
-#endif
+#include "u2f2_helpers.h"
 
 
 
@@ -62,17 +59,17 @@ mbed_error_t exchange_data(int target, uint32_t sig, uint32_t resp, msg_mtext_un
         memcpy((void*)&msgbuf.mtext, data_sent, data_sent_len);
     }
 
-    log_printf("%s: send data %x (len %d) to %d\n", __func__, sig, data_sent_len, target);
+    log_printf("%s: send data %x (len %d) to %d\n", __func__, sig, (int)data_sent_len, target);
     /* TODO errno/errcode */
     /* syncrhonously send request */
-    msgsnd(target, &msgbuf, data_sent_len, 0);
+    u2f2_msgsnd(target, &msgbuf, data_sent_len, 0);
     /* and get back response */
-    if (unlikely((len = msgrcv(target, &msgbuf, *data_recv_len, resp, 0)) == -1)) {
+    if (unlikely((len = u2f2_msgrcv(target, &msgbuf, *data_recv_len, resp, 0)) == -1)) {
         log_printf("%s: error while receiving !\n", __func__);
     }
     memcpy(data_recv, &msgbuf.mtext.u8[0], len);
 
-    log_printf("%s: receiving data %x (len %d) from %d\n", __func__, resp, *data_recv_len, target);
+    log_printf("%s: receiving data %x (len %d) from %d\n", __func__, resp, (int)*data_recv_len, target);
 err:
     return errcode;
 }
@@ -90,9 +87,9 @@ mbed_error_t send_signal_with_acknowledge(int target, uint32_t sig, uint32_t res
     log_printf("%s: send signal %x to %d\n", __func__, sig, target);
     /* TODO errno/errcode */
     /* syncrhonously send request */
-    msgsnd(target, &msgbuf, 0, 0);
+    u2f2_msgsnd(target, &msgbuf, 0, 0);
     /* and wait for response */
-    if (unlikely((len = msgrcv(target, &msgbuf, msgsz, resp, 0)) == -1)) {
+    if (unlikely((len = u2f2_msgrcv(target, &msgbuf, msgsz, resp, 0)) == -1)) {
         log_printf("%s: error while receiving !\n", __func__);
     }
 
@@ -112,17 +109,17 @@ mbed_error_t transmit_signal_to_backend_with_acknowledge(int source, int backend
 
     log_printf("%s: receiving signal %x from %d\n", __func__, sig, source);
     /* TODO errno/errcode */
-    msgrcv(source, &msgbuf, msgsz, sig, 0);
+    u2f2_msgrcv(source, &msgbuf, msgsz, sig, 0);
     /* syncrhonously transfer to backend */
     log_printf("%s: send signal %x to %d\n", __func__, sig, backend);
-    msgsnd(backend, &msgbuf, 0, 0);
+    u2f2_msgsnd(backend, &msgbuf, 0, 0);
     /* and wait for response */
-    msgrcv(backend, &msgbuf, msgsz, resp, 0);
+    u2f2_msgrcv(backend, &msgbuf, msgsz, resp, 0);
     log_printf("%s: receiving signal %x from %d\n", __func__, resp, backend);
     /* then transmit back to source */
     msgbuf.mtype = resp;
     log_printf("%s: sending back signal %x from %d\n", __func__, resp, source);
-    msgsnd(source, &msgbuf, 0, 0);
+    u2f2_msgsnd(source, &msgbuf, 0, 0);
 
     return errcode;
 }
@@ -139,7 +136,7 @@ mbed_error_t transmit_signal_to_backend_with_hooks(int source, int backend, uint
     msgbuf.mtype = sig;
 
     /* TODO errno/errcode */
-    msgrcv(source, &msgbuf, msgsz, sig, 0);
+    u2f2_msgrcv(source, &msgbuf, msgsz, sig, 0);
     /* prehook ? */
     if (prehook != NULL) {
         handler_sanity_check_with_panic((physaddr_t)prehook);
@@ -147,9 +144,9 @@ mbed_error_t transmit_signal_to_backend_with_hooks(int source, int backend, uint
     prehook();
 
     /* syncrhonously transfer to backend */
-    msgsnd(backend, &msgbuf, 0, 0);
+    u2f2_msgsnd(backend, &msgbuf, 0, 0);
     /* and wait for response */
-    msgrcv(backend, &msgbuf, msgsz, resp, 0);
+    u2f2_msgrcv(backend, &msgbuf, msgsz, resp, 0);
     /* posthook ? */
     if (posthook != NULL) {
         handler_sanity_check_with_panic((physaddr_t)posthook);
@@ -158,7 +155,7 @@ mbed_error_t transmit_signal_to_backend_with_hooks(int source, int backend, uint
 
     /* then transmit back to source */
     msgbuf.mtype = resp;
-    msgsnd(source, &msgbuf, 0, 0);
+    u2f2_msgsnd(source, &msgbuf, 0, 0);
 
     return errcode;
 }
@@ -173,7 +170,7 @@ mbed_error_t handle_signal(int source, uint32_t sig, uint32_t resp, u2f2_transmi
 
     log_printf("%s: receiving signal %x from %d\n", __func__, sig, source);
     /* TODO errno/errcode */
-    msgrcv(source, &msgbuf, msgsz, sig, 0);
+    u2f2_msgrcv(source, &msgbuf, msgsz, sig, 0);
     /* prehook ? */
     if (hook != NULL) {
         handler_sanity_check_with_panic((physaddr_t)hook);
@@ -187,7 +184,222 @@ mbed_error_t handle_signal(int source, uint32_t sig, uint32_t resp, u2f2_transmi
     /* then transmit back to source */
     msgbuf.mtype = resp;
     log_printf("%s: sending back signal %x from %d\n", __func__, resp, source);
-    msgsnd(source, &msgbuf, 0, 0);
+    u2f2_msgsnd(source, &msgbuf, 0, 0);
+err:
+    return errcode;
+}
+
+
+/*
+ * Probe a set of backends in parallel, instead of a sequence of blocking
+ * send_signal_with_acknowledge(MAGIC_IS_BACKEND_READY, MAGIC_BACKEND_IS_READY).
+ * Backends which have already pushed their readiness (see signal_backend_ready())
+ * are not probed. Probes are sent without blocking, a backend not ready to receive
+ * its probe being probed again up to the deadline.
+ */
+mbed_error_t wait_for_backends(const int *targets, uint8_t num, uint32_t timeout_ms, uint32_t *ready_bitmap)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    struct msgbuf msgbuf;
+    uint32_t all = 0;
+    uint32_t probed = 0;
+    uint64_t start = 0;
+    uint64_t now = 0;
+
+    /* sanitize */
+    if (targets == NULL || ready_bitmap == NULL) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+    if (num == 0 || num > 32) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+    *ready_bitmap = 0;
+    all = (num == 32) ? 0xffffffffUL : ((1UL << num) - 1);
+
+    /* the deadline includes the probes emission */
+    sys_get_systick(&start, PREC_MILLI);
+    for (;;) {
+        for (uint8_t i = 0; i < num; ++i) {
+            if (*ready_bitmap & (1UL << i)) {
+                continue;
+            }
+            /* already pushed readiness, or probe acknowledged ? */
+            if (u2f2_msgrcv(targets[i], &msgbuf, 0, MAGIC_BACKEND_IS_READY, IPC_NOWAIT) != -1) {
+                log_printf("%s: receiving signal %x from %d\n", __func__, (uint32_t)MAGIC_BACKEND_IS_READY, targets[i]);
+                *ready_bitmap |= (1UL << i);
+                continue;
+            }
+            if (!(probed & (1UL << i))) {
+                msgbuf.mtype = MAGIC_IS_BACKEND_READY;
+                if (u2f2_msgsnd(targets[i], &msgbuf, 0, IPC_NOWAIT) != -1) {
+                    log_printf("%s: send signal %x to %d\n", __func__, (uint32_t)MAGIC_IS_BACKEND_READY, targets[i]);
+                    probed |= (1UL << i);
+                }
+            }
+        }
+        if (*ready_bitmap == all) {
+            break;
+        }
+        if (timeout_ms != 0) {
+            sys_get_systick(&now, PREC_MILLI);
+            if ((now - start) >= timeout_ms) {
+                log_printf("%s: deadline reached, ready bitmap is %x\n", __func__, *ready_bitmap);
+                errcode = MBED_ERROR_NOTREADY;
+                goto err;
+            }
+        }
+        /* leaving the CPU to the backends we are waiting for, being awoken by their IPC */
+        sys_sleep(CONFIG_USR_LIB_U2F2_READY_POLL_PERIOD, SLEEP_MODE_INTERRUPTIBLE);
+    }
+err:
+    return errcode;
+}
+
+mbed_error_t signal_backend_ready(int target)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    struct msgbuf msgbuf;
+
+    /* a probe may already be there, it is answered by this very signal */
+    u2f2_msgrcv(target, &msgbuf, 0, MAGIC_IS_BACKEND_READY, IPC_NOWAIT);
+
+    msgbuf.mtype = MAGIC_BACKEND_IS_READY;
+    log_printf("%s: send signal %x to %d\n", __func__, (uint32_t)MAGIC_BACKEND_IS_READY, target);
+    if (unlikely(u2f2_msgsnd(target, &msgbuf, 0, 0) == -1)) {
+        log_printf("%s: failure while sending, errno=%d\n", __func__, errno);
+        errcode = MBED_ERROR_UNKNOWN;
+    }
+    return errcode;
+}
+
+
+/*
+ * Control signals, always received before bulk traffic (metadata streams, APDU fragments).
+ */
+static const uint32_t u2f2_high_prio_mtypes[] = {
+    MAGIC_WINK_REQ,
+    MAGIC_USER_PRESENCE_REQ,
+    MAGIC_USER_PRESENCE_METADATA_REQ,
+    MAGIC_USER_PRESENCE_ACK,
+    MAGIC_PETPIN_INSERT,
+    MAGIC_PETPIN_INSERTED,
+    MAGIC_USERPIN_INSERT,
+    MAGIC_USERPIN_INSERTED,
+    MAGIC_PASSPHRASE_CONFIRM,
+    MAGIC_PASSPHRASE_RESULT,
+    MAGIC_TOKEN_UNLOCKED,
+    MAGIC_IS_BACKEND_READY,
+    MAGIC_BACKEND_IS_READY,
+};
+
+u2f2_msg_prio_t u2f2_msg_priority(uint32_t mtype)
+{
+    for (uint8_t i = 0; i < sizeof(u2f2_high_prio_mtypes)/sizeof(uint32_t); ++i) {
+        if (u2f2_high_prio_mtypes[i] == mtype) {
+            return U2F2_PRIO_HIGH;
+        }
+    }
+    return U2F2_PRIO_BULK;
+}
+
+mbed_error_t u2f2_prio_init(u2f2_prio_ctx_t *ctx, int source)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    if (ctx == NULL) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+    memset(ctx, 0x0, sizeof(u2f2_prio_ctx_t));
+    ctx->source = source;
+err:
+    return errcode;
+}
+
+mbed_error_t u2f2_prio_defer(u2f2_prio_ctx_t *ctx, const struct msgbuf *msgbuf, size_t len)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    if (ctx == NULL || msgbuf == NULL || len > sizeof(msg_mtext_union_t)) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+    if (ctx->deferred_num == CONFIG_USR_LIB_U2F2_PRIO_DEFERRED_DEPTH) {
+        errcode = MBED_ERROR_NOMEM;
+        goto err;
+    }
+    u2f2_deferred_msg_t *deferred = &ctx->deferred[(ctx->deferred_head + ctx->deferred_num) % CONFIG_USR_LIB_U2F2_PRIO_DEFERRED_DEPTH];
+    deferred->msgbuf.mtype = msgbuf->mtype;
+    memcpy(&deferred->msgbuf.mtext, &msgbuf->mtext, len);
+    deferred->len = len;
+    ctx->deferred_num++;
+err:
+    return errcode;
+}
+
+/* count a received high priority message, saturating */
+static inline void prio_count_high(u2f2_prio_ctx_t *ctx)
+{
+    if (ctx->high_in_row < 0xff) {
+        ctx->high_in_row++;
+    }
+}
+
+mbed_error_t recv_msg_by_priority(u2f2_prio_ctx_t *ctx, struct msgbuf *msgbuf, size_t msgsz, ssize_t *len)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    ssize_t ret;
+
+    /* sanitize */
+    if (ctx == NULL || msgbuf == NULL || len == NULL) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+    if (msgsz > sizeof(msg_mtext_union_t)) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+    /* control signals already received during a stream */
+    if (ctx->deferred_num > 0) {
+        u2f2_deferred_msg_t *deferred = &ctx->deferred[ctx->deferred_head];
+        if (deferred->len > msgsz) {
+            errcode = MBED_ERROR_NOMEM;
+            goto err;
+        }
+        msgbuf->mtype = deferred->msgbuf.mtype;
+        memcpy(&msgbuf->mtext, &deferred->msgbuf.mtext, deferred->len);
+        ret = deferred->len;
+        ctx->deferred_head = (ctx->deferred_head + 1) % CONFIG_USR_LIB_U2F2_PRIO_DEFERRED_DEPTH;
+        ctx->deferred_num--;
+        prio_count_high(ctx);
+        goto found;
+    }
+    /* mtypes are 32 bits magics, which do not fit in the [1, LONG_MAX] range used by
+     * negative msgtyp selection: all the high priority mtypes are probed one by one instead,
+     * so that a pending control signal is always received before any bulk message */
+    if (ctx->high_in_row < CONFIG_USR_LIB_U2F2_PRIO_MAX_HIGH_IN_ROW) {
+        for (uint8_t i = 0; i < sizeof(u2f2_high_prio_mtypes)/sizeof(uint32_t); ++i) {
+            if ((ret = u2f2_msgrcv(ctx->source, msgbuf, msgsz, u2f2_high_prio_mtypes[i], IPC_NOWAIT)) != -1) {
+                prio_count_high(ctx);
+                goto found;
+            }
+        }
+    }
+    /* no pending control signal, or bulk traffic starving: getting the oldest message,
+     * whatever its priority is */
+    if (unlikely((ret = u2f2_msgrcv(ctx->source, msgbuf, msgsz, 0, 0)) == -1)) {
+        log_printf("%s: error while receiving, errno=%d\n", __func__, errno);
+        errcode = MBED_ERROR_UNKNOWN;
+        goto err;
+    }
+    if (u2f2_msg_priority(msgbuf->mtype) == U2F2_PRIO_HIGH) {
+        prio_count_high(ctx);
+    } else {
+        ctx->high_in_row = 0;
+    }
+found:
+    log_printf("%s: receiving %x (len %d) from %d\n", __func__, (uint32_t)msgbuf->mtype, (int)ret, ctx->source);
+    *len = ret;
 err:
     return errcode;
 }
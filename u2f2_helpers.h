@@ -30,5 +30,16 @@
 # define log_printf(...)
 #endif
 
+/*
+ * IPC primitives used by all the helpers, recorded in the trace when capture is enabled
+ */
+#if CONFIG_USR_LIB_U2F2_TRACE
+int u2f2_msgsnd(int msqid, const void *msgp, size_t msgsz, int msgflg);
+ssize_t u2f2_msgrcv(int msqid, void *msgp, size_t msgsz, long msgtyp, int msgflg);
+#else
+# define u2f2_msgsnd(...) msgsnd(__VA_ARGS__)
+# define u2f2_msgrcv(...) msgrcv(__VA_ARGS__)
+#endif
+
 
 #endif
@@ -0,0 +1,135 @@
+/*
+ *
+ * Copyright 2019 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * the Free Software Foundation; either version 3 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+#ifndef LIBU2F2_METADATA_DESC_H_
+#define LIBU2F2_METADATA_DESC_H_
+
+#include "api/libu2f2.h"
+#include "libc/string.h"
+
+/*
+ * appid metadata wire format, shared by the GET and SET metadata streams.
+ *
+ * X(msg_type, field, kind, wtype, wlen, icon_type)
+ * @msg_type  the message type carrying the field
+ * @field     the fidostorage_appid_slot_t field
+ * @kind      SCALAR (wtype integer), BYTES (wlen bytes) or STRING (up to wlen bytes,
+ *            including the trailing '\0')
+ * @wtype     the msg_mtext_union_t member used for SCALAR fields
+ * @wlen      the field length on the wire
+ * @icon_type the icon type for which the field is transmitted (U2F2_ICON_TYPE_ANY: always)
+ *
+ * Fields are emitted in this order. Image icon content (MAGIC_APPID_METADATA_ICON chunks)
+ * is streamed after the table fields, when icon_type is ICON_TYPE_IMAGE.
+ */
+#define U2F2_ICON_TYPE_ANY 0xffff
+
+#if CONFIG_USR_LIB_U2F2_METADATA_NAME
+# define U2F2_METADATA_NAME_FIELD(X) \
+    X(MAGIC_APPID_METADATA_NAME,       name,           STRING, u8,  60, U2F2_ICON_TYPE_ANY)
+#else
+# define U2F2_METADATA_NAME_FIELD(X)
+#endif
+
+#if CONFIG_USR_LIB_U2F2_METADATA_FLAGS
+# define U2F2_METADATA_FLAGS_FIELD(X) \
+    X(MAGIC_APPID_METADATA_FLAGS,      flags,          SCALAR, u32, 4,  U2F2_ICON_TYPE_ANY)
+#else
+# define U2F2_METADATA_FLAGS_FIELD(X)
+#endif
+
+#if CONFIG_USR_LIB_U2F2_ICON_COLOR
+# define U2F2_METADATA_COLOR_FIELD(X) \
+    X(MAGIC_APPID_METADATA_COLOR,      icon.rgb_color, BYTES,  u8,  3,  ICON_TYPE_COLOR)
+#else
+# define U2F2_METADATA_COLOR_FIELD(X)
+#endif
+
+#if CONFIG_USR_LIB_U2F2_ICON_IMAGE
+# define U2F2_METADATA_ICON_START_FIELD(X) \
+    X(MAGIC_APPID_METADATA_ICON_START, icon_len,       SCALAR, u16, 2,  ICON_TYPE_IMAGE)
+#else
+# define U2F2_METADATA_ICON_START_FIELD(X)
+#endif
+
+#define U2F2_METADATA_FIELDS(X) \
+    U2F2_METADATA_NAME_FIELD(X) \
+    X(MAGIC_APPID_METADATA_CTR,        ctr,            SCALAR, u32, 4,  U2F2_ICON_TYPE_ANY) \
+    U2F2_METADATA_FLAGS_FIELD(X) \
+    X(MAGIC_APPID_METADATA_ICON_TYPE,  icon_type,      SCALAR, u16, 2,  U2F2_ICON_TYPE_ANY) \
+    U2F2_METADATA_COLOR_FIELD(X) \
+    U2F2_METADATA_ICON_START_FIELD(X)
+
+/* is the field transmitted for the given slot ? */
+#define U2F2_FIELD_APPLIES(mt, icon_type_) \
+    (((icon_type_) == U2F2_ICON_TYPE_ANY) || ((mt)->icon_type == (icon_type_)))
+
+/*
+ * Encoders: fill msgbuf content with the field, returns the content length
+ */
+#define U2F2_ENCODE_SCALAR(msgbuf, mt, field, wtype, wlen) \
+    ((msgbuf)->mtext.wtype[0] = (mt)->field, (size_t)(wlen))
+#define U2F2_ENCODE_BYTES(msgbuf, mt, field, wtype, wlen) \
+    (memcpy(&(msgbuf)->mtext.u8[0], &(mt)->field[0], (wlen)), (size_t)(wlen))
+#define U2F2_ENCODE_STRING(msgbuf, mt, field, wtype, wlen) \
+    u2f2_encode_string((msgbuf), &(mt)->field[0], (wlen))
+
+/*
+ * Decoders: set the field from msgbuf content of len bytes, returns false if the
+ * content is invalid (the field is then left untouched). Strings longer than the
+ * field are truncated.
+ */
+#define U2F2_DECODE_SCALAR(msgbuf, len, mt, field, wtype, wlen) \
+    (((len) == (wlen)) ? ((mt)->field = (msgbuf)->mtext.wtype[0], true) : false)
+#define U2F2_DECODE_BYTES(msgbuf, len, mt, field, wtype, wlen) \
+    (((len) == (wlen)) ? (memcpy(&(mt)->field[0], &(msgbuf)->mtext.u8[0], (wlen)), true) : false)
+#define U2F2_DECODE_STRING(msgbuf, len, mt, field, wtype, wlen) \
+    u2f2_decode_string((msgbuf), (len), &(mt)->field[0], (wlen))
+
+static inline size_t u2f2_encode_string(struct msgbuf *msgbuf, const uint8_t *str, size_t wlen)
+{
+    size_t len = 0;
+    /* at most wlen - 1 chars, and always a trailing '\0' */
+    while (len < (wlen - 1) && str[len] != '\0') {
+        msgbuf->mtext.u8[len] = str[len];
+        len++;
+    }
+    msgbuf->mtext.u8[len] = '\0';
+    return len + 1;
+}
+
+static inline bool u2f2_decode_string(const struct msgbuf *msgbuf, ssize_t len, uint8_t *str, size_t wlen)
+{
+    if (len <= 0) {
+        return false;
+    }
+    /* truncate to wlen - 1 chars, the field is always '\0' terminated */
+    if ((size_t)len > (wlen - 1)) {
+        len = wlen - 1;
+    }
+    memset(str, 0x0, wlen);
+    memcpy(str, &msgbuf->mtext.u8[0], len);
+    return true;
+}
+
+#endif/*!LIBU2F2_METADATA_DESC_H_*/
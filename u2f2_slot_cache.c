@@ -0,0 +1,110 @@
+/*
+ *
+ * Copyright 2019 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * the Free Software Foundation; either version 3 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+#include "api/libu2f2.h"
+#include "libc/string.h"
+
+#include "u2f2_slot_cache.h"
+
+/*
+ * (appid, kh) to slotid index, avoiding the storage slots walk of fidostorage_get_appid_slot()
+ * for known credentials. Entries are hashed on the appid only (itself a hash), so that
+ * template lookups (appid without kh) hit as well, with linear probing on collisions.
+ * The cache is only a hint: the caller must check the slot against the shadow bitmap on hit.
+ */
+
+static inline uint8_t slot_cache_bucket(const uint8_t *appid)
+{
+    return appid[0] % CONFIG_USR_LIB_U2F2_SLOT_CACHE_SIZE;
+}
+
+mbed_error_t u2f2_slot_cache_init(u2f2_slot_cache_t *cache)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    if (cache == NULL) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+    memset(cache, 0x0, sizeof(u2f2_slot_cache_t));
+err:
+    return errcode;
+}
+
+u2f2_slot_cache_entry_t *u2f2_slot_cache_lookup(u2f2_slot_cache_t *cache, const uint8_t *appid, const uint8_t *kh)
+{
+    uint8_t bucket = slot_cache_bucket(appid);
+
+    for (uint8_t i = 0; i < CONFIG_USR_LIB_U2F2_SLOT_CACHE_SIZE; ++i) {
+        u2f2_slot_cache_entry_t *entry = &cache->entries[(bucket + i) % CONFIG_USR_LIB_U2F2_SLOT_CACHE_SIZE];
+        if (!entry->valid) {
+            continue;
+        }
+        if (memcmp(entry->appid, appid, 32) != 0) {
+            continue;
+        }
+        if (kh != NULL && memcmp(entry->kh, kh, 32) != 0) {
+            continue;
+        }
+        if (kh == NULL && !entry->hmac_valid) {
+            /* the template slot can't be authenticated from this entry */
+            continue;
+        }
+        return entry;
+    }
+    return NULL;
+}
+
+void u2f2_slot_cache_insert(u2f2_slot_cache_t *cache, const uint8_t *appid, const uint8_t *kh, const uint8_t *hmac, uint32_t slotid)
+{
+    uint8_t bucket = slot_cache_bucket(appid);
+    u2f2_slot_cache_entry_t *entry = u2f2_slot_cache_lookup(cache, appid, kh);
+
+    if (entry == NULL) {
+        /* first free entry from the bucket, or evicting the bucket's one */
+        entry = &cache->entries[bucket];
+        for (uint8_t i = 0; i < CONFIG_USR_LIB_U2F2_SLOT_CACHE_SIZE; ++i) {
+            u2f2_slot_cache_entry_t *cur = &cache->entries[(bucket + i) % CONFIG_USR_LIB_U2F2_SLOT_CACHE_SIZE];
+            if (!cur->valid) {
+                entry = cur;
+                break;
+            }
+        }
+    }
+    memcpy(entry->appid, appid, 32);
+    memcpy(entry->kh, kh, 32);
+    if (hmac != NULL) {
+        memcpy(entry->hmac, hmac, 32);
+        entry->hmac_valid = true;
+    } else {
+        entry->hmac_valid = false;
+    }
+    entry->slotid = slotid;
+    entry->valid = true;
+}
+
+void u2f2_slot_cache_drop(u2f2_slot_cache_entry_t *entry)
+{
+    if (entry != NULL) {
+        entry->valid = false;
+    }
+}
@@ -0,0 +1,47 @@
+/*
+ *
+ * Copyright 2019 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * the Free Software Foundation; either version 3 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+#ifndef LIBU2F2_SLOT_CACHE_H_
+#define LIBU2F2_SLOT_CACHE_H_
+
+#include "api/libu2f2.h"
+
+/*
+ * Get back the cache entry of (appid, kh), or of any slot of appid if kh is NULL.
+ * Template lookups (kh is NULL) only match entries holding the slot hmac, so that the
+ * template slot is always checked when read back.
+ * Returns NULL if not found.
+ */
+u2f2_slot_cache_entry_t *u2f2_slot_cache_lookup(u2f2_slot_cache_t *cache, const uint8_t *appid, const uint8_t *kh);
+
+/*
+ * Register (appid, kh) as living in slotid. hmac can be NULL if unknown.
+ */
+void u2f2_slot_cache_insert(u2f2_slot_cache_t *cache, const uint8_t *appid, const uint8_t *kh, const uint8_t *hmac, uint32_t slotid);
+
+/*
+ * Forget a stale entry
+ */
+void u2f2_slot_cache_drop(u2f2_slot_cache_entry_t *entry);
+
+#endif/*!LIBU2F2_SLOT_CACHE_H_*/
@@ -25,8 +25,11 @@
 #include "libc/string.h"
 #include "libc/stdio.h"
 #include "libc/malloc.h"
+#include "libc/syscall.h"
 
 #include "u2f2_helpers.h"
+#include "u2f2_metadata_desc.h"
+#include "u2f2_slot_cache.h"
 
 
 
@@ -53,31 +56,298 @@
  *
  */
 
+mbed_error_t u2f2_storage_session_init(u2f2_storage_session_t *session, int msq, uint8_t *icon_buf, uint16_t icon_buf_len)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    if (session == NULL) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+    if (icon_buf == NULL && icon_buf_len != 0) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+    memset(session, 0x0, sizeof(u2f2_storage_session_t));
+    session->msq = msq;
+    session->icon_buf = icon_buf;
+    session->icon_buf_len = icon_buf_len;
+err:
+    return errcode;
+}
+
+mbed_error_t u2f2_storage_session_set_slot_cache(u2f2_storage_session_t *session, u2f2_slot_cache_t *cache)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    if (session == NULL) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+    session->slot_cache = cache;
+err:
+    return errcode;
+}
+
+mbed_error_t u2f2_storage_session_set_stream_tagging(u2f2_storage_session_t *session, bool enable)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    if (session == NULL) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+    session->stream_tagging = enable;
+    session->stream_id = 0;
+err:
+    return errcode;
+}
+
+mbed_error_t u2f2_storage_session_set_prio(u2f2_storage_session_t *session, u2f2_prio_ctx_t *prio)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    if (session == NULL) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+    session->prio = prio;
+err:
+    return errcode;
+}
+
+uint8_t u2f2_request_stream_id(const struct msgbuf *msgbuf, size_t len, size_t base_len)
+{
+    if (msgbuf == NULL || base_len >= sizeof(msg_mtext_union_t) || len != (base_len + 1)) {
+        /* legacy request, untagged stream */
+        return 0;
+    }
+    return msgbuf->mtext.u8[base_len];
+}
+
 /*
- * get back appid associated metadata. If the appid exists and has an icon, the appid_icon pointer is allocated
- * dynamically to the correct icon size (set in appid_info), otherwhise, it is set to NULL.
+ * Metadata stream messages, drained on resynchronization
  */
-mbed_error_t request_appid_metada(int msq, uint8_t *appid, fidostorage_appid_slot_t *appid_info, uint8_t    **appid_icon_p)
+static const uint32_t u2f2_stream_mtypes[] = {
+    MAGIC_APPID_METADATA_IDENTIFIERS,
+    MAGIC_APPID_METADATA_STATUS,
+    MAGIC_APPID_METADATA_NAME,
+    MAGIC_APPID_METADATA_CTR,
+    MAGIC_APPID_METADATA_FLAGS,
+    MAGIC_APPID_METADATA_ICON_TYPE,
+    MAGIC_APPID_METADATA_COLOR,
+    MAGIC_APPID_METADATA_ICON_START,
+    MAGIC_APPID_METADATA_ICON,
+    MAGIC_APPID_METADATA_END,
+    MAGIC_APPID_LOOKUP_CANDIDATE,
+    MAGIC_APPID_LOOKUP_RESULT,
+};
+
+/*
+ * drop, without blocking, the messages of the given stream already in the queue, up to
+ * max_msgs messages. The number of dropped messages is set in drained.
+ */
+static mbed_error_t stream_drain(u2f2_storage_session_t *session, uint8_t stream_id, uint16_t max_msgs, uint16_t *drained)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    struct msgbuf msgbuf;
+
+    *drained = 0;
+    for (uint8_t i = 0; i < sizeof(u2f2_stream_mtypes)/sizeof(uint32_t); ++i) {
+        while (u2f2_msgrcv(session->msq, &msgbuf, sizeof(msg_mtext_union_t), U2F2_STREAM_MTYPE(u2f2_stream_mtypes[i], stream_id), IPC_NOWAIT) != -1) {
+            if (++(*drained) >= max_msgs) {
+                log_printf("[u2f2] stream %d resync budget reached\n", stream_id);
+                errcode = MBED_ERROR_BUSY;
+                goto err;
+            }
+        }
+    }
+err:
+    return errcode;
+}
+
+/*
+ * receive the next message of the given stream, any other message (e.g. a control signal)
+ * being left in the queue. The stream mtypes are probed without blocking, from the last
+ * received one (idx), the task yielding until the next IPC when none is pending.
+ */
+static ssize_t stream_recv(u2f2_storage_session_t *session, struct msgbuf *msgbuf, size_t msgsz, uint8_t stream_id, uint8_t *idx)
+{
+    const uint8_t num = sizeof(u2f2_stream_mtypes)/sizeof(uint32_t);
+    ssize_t len;
+
+    for (;;) {
+        for (uint8_t i = 0; i < num; ++i) {
+            uint8_t cur = (*idx + i) % num;
+            if ((len = u2f2_msgrcv(session->msq, msgbuf, msgsz, U2F2_STREAM_MTYPE(u2f2_stream_mtypes[cur], stream_id), IPC_NOWAIT)) != -1) {
+                *idx = cur;
+                return len;
+            }
+        }
+        sys_yield();
+    }
+}
+
+/*
+ * record a broken tagged stream. If no record is free, the first one is evicted.
+ */
+static void stream_set_dead(u2f2_storage_session_t *session, uint8_t stream_id)
+{
+    u2f2_dead_stream_t *dead = NULL;
+
+    for (uint8_t i = 0; i < CONFIG_USR_LIB_U2F2_DEAD_STREAMS; ++i) {
+        if (session->dead_streams[i].stream_id == stream_id) {
+            dead = &session->dead_streams[i];
+            break;
+        }
+        if (dead == NULL && session->dead_streams[i].stream_id == 0) {
+            dead = &session->dead_streams[i];
+        }
+    }
+    if (dead == NULL) {
+        memmove(&session->dead_streams[0], &session->dead_streams[1], (CONFIG_USR_LIB_U2F2_DEAD_STREAMS - 1) * sizeof(u2f2_dead_stream_t));
+        dead = &session->dead_streams[CONFIG_USR_LIB_U2F2_DEAD_STREAMS - 1];
+    }
+    dead->stream_id = stream_id;
+    dead->quiet_passes = 0;
+}
+
+/*
+ * called at the beginning of each request, once its stream id is known: the leftovers of
+ * the previously broken streams are drained. As the peer handles the requests in order,
+ * a dead stream is forgotten once two drains in a row have found none of its messages,
+ * or as soon as its id is reused by the current stream.
+ */
+static void stream_drain_dead(u2f2_storage_session_t *session)
+{
+    uint16_t drained;
+
+    for (uint8_t i = 0; i < CONFIG_USR_LIB_U2F2_DEAD_STREAMS; ++i) {
+        u2f2_dead_stream_t *dead = &session->dead_streams[i];
+        if (dead->stream_id == 0) {
+            continue;
+        }
+        if (dead->stream_id == session->stream_id) {
+            /* id reused, its messages now belong to the current stream */
+            dead->stream_id = 0;
+            continue;
+        }
+        stream_drain(session, dead->stream_id, CONFIG_USR_LIB_U2F2_RESYNC_MAX_MSGS, &drained);
+        if (drained != 0) {
+            log_printf("[u2f2] stream %d: %d late message(s) dropped\n", dead->stream_id, drained);
+            dead->quiet_passes = 0;
+        } else {
+            dead->quiet_passes++;
+        }
+        if (dead->quiet_passes >= 2) {
+            dead->stream_id = 0;
+        }
+    }
+}
+
+/*
+ * select a new stream id for the request to be sent (if tagging is enabled) and append it
+ * to the request content of base_len bytes. Returns the request content length.
+ */
+static size_t set_request_stream_id(u2f2_storage_session_t *session, struct msgbuf *msgbuf, size_t base_len)
+{
+    size_t len = base_len;
+
+    if (!session->stream_tagging) {
+        session->stream_id = 0;
+    } else {
+        /* 1 to 255, 0 being the untagged stream */
+        session->stream_id = (session->stream_id % 255) + 1;
+        msgbuf->mtext.u8[base_len] = session->stream_id;
+        len = base_len + 1;
+    }
+    stream_drain_dead(session);
+    return len;
+}
+
+mbed_error_t u2f2_stream_resync(u2f2_storage_session_t *session, uint8_t stream_id, uint16_t max_msgs)
 {
-    log_printf("%s", __func__);
     mbed_error_t errcode = MBED_ERROR_NONE;
-    if (appid == NULL || appid_info == NULL || appid_icon_p == NULL) {
+    uint16_t drained = 0;
+
+    if (session == NULL) {
         errcode = MBED_ERROR_INVPARAM;
         goto err;
     }
+    if (stream_id != 0) {
+        /* the peer may still be emitting the stream: drained again by the next requests */
+        stream_set_dead(session, stream_id);
+    }
+    if ((errcode = stream_drain(session, stream_id, max_msgs, &drained)) != MBED_ERROR_NONE) {
+        goto err;
+    }
+    log_printf("[u2f2] stream %d resync: %d message(s) dropped\n", stream_id, drained);
+err:
+    return errcode;
+}
+
+/*
+ * resolve the slot of (appid, kh) and read back its metadata in mt. When kh_known is false,
+ * any slot of appid is resolved (template) and its kh is returned in kh.
+ * hmac (can be NULL) is the slot hmac, used to check the slot when reading it back.
+ * The session slot cache is used first, the cached slot being checked against the fetched
+ * shadow bitmap (still allocated to appid, kh) before being read back (with its hmac for
+ * templates, entries without hmac never matching). The storage is walked otherwise.
+ */
+static mbed_error_t resolve_appid_slot(u2f2_storage_session_t *session, uint8_t *appid, uint8_t *kh, bool kh_known, uint8_t *hmac, uint32_t *slotid, fidostorage_appid_slot_t *mt)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    u2f2_slot_cache_entry_t *entry = NULL;
+
+    if (session->slot_cache != NULL) {
+        entry = u2f2_slot_cache_lookup(session->slot_cache, appid, kh_known ? kh : NULL);
+    }
+    if (entry != NULL) {
+        uint8_t *entry_hmac = NULL;
+        if (!kh_known) {
+            memcpy(kh, entry->kh, 32);
+        }
+        if (hmac != NULL && entry->hmac_valid) {
+            memcpy(hmac, entry->hmac, 32);
+            entry_hmac = hmac;
+        }
+        if (fidostorage_check_appid_slot(appid, kh, entry->slotid) == MBED_ERROR_NONE &&
+            fidostorage_get_appid_metadata(appid, kh, entry->slotid, entry_hmac, mt) == MBED_ERROR_NONE) {
+            *slotid = entry->slotid;
+            goto err;
+        }
+        /* the slot has been moved or reused since, falling back to storage walk */
+        log_printf("[u2f2] stale slot cache entry, dropping\n");
+        u2f2_slot_cache_drop(entry);
+    }
+    if (unlikely((errcode = fidostorage_get_appid_slot(appid, kh, slotid, hmac, NULL, false)) != MBED_ERROR_NONE)) {
+        goto err;
+    }
+    if (unlikely((errcode = fidostorage_get_appid_metadata(appid, kh, *slotid, hmac, mt)) != MBED_ERROR_NONE)) {
+        goto err;
+    }
+    if (session->slot_cache != NULL) {
+        u2f2_slot_cache_insert(session->slot_cache, appid, kh, hmac, *slotid);
+    }
+err:
+    return errcode;
+}
+
+/*
+ * receive the metadata stream emitted by send_appid_metadata(), from
+ * MAGIC_APPID_METADATA_STATUS up to MAGIC_APPID_METADATA_END. The request
+ * itself has already been sent by the caller.
+ */
+static mbed_error_t recv_appid_metadata(u2f2_storage_session_t *session, fidostorage_appid_slot_t *appid_info, uint8_t **appid_icon_p)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    int msq = session->msq;
+    uint8_t sid = session->stream_id;
     struct msgbuf msgbuf = { 0 };
     size_t msg_len = 0;
     ssize_t len;
 
-    /* we know the appid, set the appid field localy */
-    memcpy(appid_info->appid, appid, 32);
-    /* sending get_metadata request */
-    msgbuf.mtype = MAGIC_STORAGE_GET_METADATA;
-    memcpy(&msgbuf.mtext.u8[0], appid, 32);
-    msgsnd(msq, &msgbuf, 32, 0);
+    /* no icon unless an image icon is received */
+    *appid_icon_p = NULL;
     /* read back appid status */
     msg_len = 1;
-    if (unlikely((len = msgrcv(msq, &msgbuf, msg_len, MAGIC_APPID_METADATA_STATUS, 0)) == -1)) {
+    if (unlikely((len = u2f2_msgrcv(msq, &msgbuf, msg_len, U2F2_STREAM_MTYPE(MAGIC_APPID_METADATA_STATUS, sid), 0)) == -1)) {
         log_printf("[u2f2] failure while receiving metadata status, errno=%d\n", errno);
         errcode = MBED_ERROR_UNKNOWN;
         goto err;
@@ -88,106 +358,68 @@ mbed_error_t request_appid_metada(int msq, uint8_t *appid, fidostorage_appid_slo
         errcode = MBED_ERROR_NOSTORAGE;
         goto end;
     }
-    /* appid exists, get back metadata, starting with name */
-    msg_len = 60;
-    if (unlikely((len = msgrcv(msq, &msgbuf, msg_len, MAGIC_APPID_METADATA_NAME, 0)) == -1)) {
-        log_printf("[u2f2] failure while receiving metadata name, errno=%d\n", errno);
-        errcode = MBED_ERROR_UNKNOWN;
-        goto err;
-    }
-    strncpy((char*)appid_info->name, &msgbuf.mtext.c[0], len);
-    /* get back CTR */
-    msg_len = 4;
-    if (unlikely((len = msgrcv(msq, &msgbuf, msg_len, MAGIC_APPID_METADATA_CTR, 0)) == -1)) {
-        log_printf("[u2f2] failure while receiving metadata ctr, errno=%d\n", errno);
-        errcode = MBED_ERROR_UNKNOWN;
-        goto err;
+    /* appid exists, get back metadata fields */
+#define X(msg_type, field, kind, wtype, wlen, icon_type) \
+    if (U2F2_FIELD_APPLIES(appid_info, icon_type)) { \
+        if (unlikely((len = u2f2_msgrcv(msq, &msgbuf, (wlen), U2F2_STREAM_MTYPE(msg_type, sid), 0)) == -1)) { \
+            log_printf("[u2f2] failure while receiving metadata " #field ", errno=%d\n", errno); \
+            errcode = MBED_ERROR_UNKNOWN; \
+            goto err; \
+        } \
+        if (!U2F2_DECODE_##kind(&msgbuf, len, appid_info, field, wtype, wlen)) { \
+            log_printf("[u2f2] received metadata " #field " is invalid (%d len)\n", (int)len); \
+            errcode = MBED_ERROR_UNKNOWN; \
+            goto err; \
+        } \
     }
-    appid_info->ctr = msgbuf.mtext.u32[0];
-    /* get back flags */
-    msg_len = 4;
-    if (unlikely((len = msgrcv(msq, &msgbuf, msg_len, MAGIC_APPID_METADATA_FLAGS, 0)) == -1)) {
-        log_printf("[u2f2] failure while receiving metadata flags, errno=%d\n", errno);
-        errcode = MBED_ERROR_UNKNOWN;
-        goto err;
-    }
-    appid_info->flags = msgbuf.mtext.u32[0];
-    /* get back icon_type */
-    msg_len = 2;
-    if (unlikely((len = msgrcv(msq, &msgbuf, msg_len, MAGIC_APPID_METADATA_ICON_TYPE, 0)) == -1)) {
-        log_printf("[u2f2] failure while receiving metadata icon_type, errno=%d\n", errno);
-        errcode = MBED_ERROR_UNKNOWN;
-        goto err;
-    }
-    appid_info->icon_type = msgbuf.mtext.u16[0];
-    /* depending on icon type, handling icon */
-    uint16_t icon_len = 0;
-    switch (appid_info->icon_type) {
-        case ICON_TYPE_NONE:
-            /* no icon */
-            appid_icon_p = NULL;
-            goto end;
-            break;
-        case ICON_TYPE_COLOR:
-            /* icon is single RGB color */
-            msg_len = 3;
-            if (unlikely(msgrcv(msq, &msgbuf, msg_len, MAGIC_APPID_METADATA_COLOR, 0) == -1)) {
-                log_printf("[u2f2] failure while receiving metadata color, errno=%d\n", errno);
-                errcode = MBED_ERROR_UNKNOWN;
-                goto err;
+    U2F2_METADATA_FIELDS(X)
+#undef X
+
+#if CONFIG_USR_LIB_U2F2_ICON_IMAGE
+    if (appid_info->icon_type == ICON_TYPE_IMAGE) {
+        /* icon is RLE image */
+        uint16_t icon_len = appid_info->icon_len;
+        /* now that we know the icon len, using the session icon buffer if any, or allocating
+         * it dynamically */
+        if (session->icon_buf != NULL) {
+            if (icon_len <= session->icon_buf_len) {
+                *appid_icon_p = session->icon_buf;
+            } else {
+                log_printf("[u2f2][warn] session icon buffer too small (%d bytes) for icon !!!\n", icon_len);
+                *appid_icon_p = NULL;
             }
-            memcpy(&appid_info->icon.rgb_color[0], &msgbuf.mtext.u8[0], 3);
-            break;
-        case ICON_TYPE_IMAGE:
-            /* icon is RLE image */
-            msg_len = 2;
-            if (unlikely(msgrcv(msq, &msgbuf, msg_len, MAGIC_APPID_METADATA_ICON_START, 0) == -1)) {
-                log_printf("[u2f2] failure while receiving metadata icon start, errno=%d\n", errno);
+        } else if (wmalloc((void**)appid_icon_p, icon_len, ALLOC_NORMAL) != 0) {
+            log_printf("[u2f2][warn] failure when allocating memory (%d bytes) for icon !!!\n", icon_len);
+            *appid_icon_p = NULL;
+        }
+        /* on failure, we don't leave here as it would break the communication, instead,
+         * the icon is set to NULL and the icon chunks are not registered locally.
+         * The task is responsible for checking the icon pointer and react */
+        uint8_t *appid_icon = *appid_icon_p;
+        uint16_t offset = 0;
+        while (offset < icon_len) {
+            msg_len = sizeof(msg_mtext_union_t);
+            if (unlikely((len = u2f2_msgrcv(msq, &msgbuf, msg_len, U2F2_STREAM_MTYPE(MAGIC_APPID_METADATA_ICON, sid), 0)) == -1)) {
+                log_printf("[u2f2] failure while receiving metadata icon, errno=%d\n", errno);
                 errcode = MBED_ERROR_UNKNOWN;
                 goto err;
             }
-            icon_len = msgbuf.mtext.u16[0];
-            appid_info->icon_len = icon_len;
-            /* now that we know the icon len, allocating it dynamically */
-            if (wmalloc((void**)appid_icon_p, icon_len, ALLOC_NORMAL) != 0) {
-                log_printf("[u2f2][warn] failure when allocating memory (%d bytes) for icon !!!\n");
-                *appid_icon_p = NULL;
-                /* we don't leave here as it would break the communication, instead, we set the
-                 * icon to NULL and don't register locally the icon chunks.
-                 * The task is responsible for checking the icon pointer and react */
+            if (len == 0 || offset + len > icon_len) {
+                log_printf("[u2f2] warn! the received icon is bigger than the declared size !\n");
+                errcode = MBED_ERROR_INVPARAM;
+                goto err;
             }
-            /* how many requests to receive to fullfill icon ? */
-            uint8_t *appid_icon = *appid_icon_p;
-            uint16_t offset = 0;
-            uint16_t len = 0;
-            while (offset < icon_len) {
-
-                msg_len = 64;
-                if (unlikely((len = msgrcv(msq, &msgbuf, msg_len, MAGIC_APPID_METADATA_ICON, 0)) == -1)) {
-                    log_printf("[u2f2] failure while receiving metadata icon, errno=%d\n", errno);
-                    errcode = MBED_ERROR_UNKNOWN;
-                    goto err;
-                }
-                if (offset + len > icon_len) {
-                    log_printf("[u2f2] warn! the received icon is bigger than the declared size !\n");
-                    errcode = MBED_ERROR_INVPARAM;
-                    goto err;
-                }
-                /* we copy the icon chunk only if the icon allocation didn't fail */
-                if (*appid_icon_p != NULL) {
-                    memcpy(&appid_icon[offset], &msgbuf.mtext.u8[0], msg_len);
-                }
-                offset += msg_len;
+            /* we copy the icon chunk only if the icon allocation didn't fail */
+            if (appid_icon != NULL) {
+                memcpy(&appid_icon[offset], &msgbuf.mtext.u8[0], len);
             }
-            break;
-        default:
-            errcode = MBED_ERROR_UNKNOWN;
-            goto err;
-            break;
+            offset += len;
+        }
     }
+#endif
 end:
     msg_len = 0;
-    if (unlikely((len = msgrcv(msq, &msgbuf, msg_len, MAGIC_APPID_METADATA_END, 0)) == -1)) {
+    if (unlikely((len = u2f2_msgrcv(msq, &msgbuf, msg_len, U2F2_STREAM_MTYPE(MAGIC_APPID_METADATA_END, sid), 0)) == -1)) {
         log_printf("[u2f2] failure while receiving metadata end, errno=%d\n", errno);
         errcode = MBED_ERROR_UNKNOWN;
         goto err;
@@ -197,29 +429,74 @@ err:
     return errcode;
 }
 
+/*
+ * get back appid associated metadata. If the appid exists and has an icon, the appid_icon pointer is allocated
+ * dynamically to the correct icon size (set in appid_info), otherwhise, it is set to NULL.
+ */
+mbed_error_t request_appid_metada_r(u2f2_storage_session_t *session, uint8_t *appid, fidostorage_appid_slot_t *appid_info, uint8_t    **appid_icon_p)
+{
+    log_printf("%s", __func__);
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    if (session == NULL || appid == NULL || appid_info == NULL || appid_icon_p == NULL) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+    struct msgbuf msgbuf = { 0 };
+    int msq = session->msq;
+
+    /* we know the appid, set the appid field localy */
+    memcpy(appid_info->appid, appid, 32);
+    /* sending get_metadata request */
+    msgbuf.mtype = MAGIC_STORAGE_GET_METADATA;
+    memcpy(&msgbuf.mtext.u8[0], appid, 32);
+    u2f2_msgsnd(msq, &msgbuf, set_request_stream_id(session, &msgbuf, 32), 0);
+
+    errcode = recv_appid_metadata(session, appid_info, appid_icon_p);
+    if (errcode != MBED_ERROR_NONE && errcode != MBED_ERROR_NOSTORAGE) {
+        /* broken stream, its leftovers are not to be read by the next request */
+        u2f2_stream_resync(session, session->stream_id, CONFIG_USR_LIB_U2F2_RESYNC_MAX_MSGS);
+    }
+err:
+    return errcode;
+}
+
+mbed_error_t request_appid_metada(int msq, uint8_t *appid, fidostorage_appid_slot_t *appid_info, uint8_t    **appid_icon_p)
+{
+    u2f2_storage_session_t session;
+    u2f2_storage_session_init(&session, msq, NULL, 0);
+    return request_appid_metada_r(&session, appid, appid_info, appid_icon_p);
+}
+
 /*
  * here, MAGIC_STORAGE_GET_METADATA has just been received from msq and appid stored in argument. responding...
  */
-mbed_error_t send_appid_metadata(int msq, uint8_t  *appid, fidostorage_appid_slot_t *appid_info, uint8_t    *appid_icon)
+mbed_error_t send_appid_metadata_r(u2f2_storage_session_t *session, uint8_t  *appid, fidostorage_appid_slot_t *appid_info, uint8_t    *appid_icon)
 {
     log_printf("%s\n", __func__);
     mbed_error_t errcode = MBED_ERROR_NONE;
-    if (appid == NULL) {
+    if (session == NULL || appid == NULL) {
         log_printf("[u2f2] appid is NULL, leaving\n");
         errcode = MBED_ERROR_INVPARAM;
         goto err;
 
     }
+    if (appid_info != NULL && appid_info->icon_type == ICON_TYPE_IMAGE && appid_info->icon_len > 0 && appid_icon == NULL) {
+        log_printf("[u2f2] an icon is to be sent, but icon arg is NULL!\n");
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
     struct msgbuf msgbuf = { 0 };
     size_t msg_len = 0;
     ssize_t len;
+    int msq = session->msq;
+    uint8_t sid = session->stream_id;
 
-    msgbuf.mtype = MAGIC_APPID_METADATA_STATUS;
+    msgbuf.mtype = U2F2_STREAM_MTYPE(MAGIC_APPID_METADATA_STATUS, sid);
     /* send back appid status */
     if (appid_info == NULL) {
         /* if no appid_info previously populated, then we consider that the appid doesn't exist in the storage, sending 0 */
         log_printf("[u2f2] appid doesn't exist, sending 0x00\n");
-        if (unlikely(msgsnd(msq, &msgbuf, 1, 0) == -1)) {
+        if (unlikely(u2f2_msgsnd(msq, &msgbuf, 1, 0) == -1)) {
             log_printf("[u2f2] failure while sending metadata status, errno=%d\n", errno);
             errcode = MBED_ERROR_UNKNOWN;
             goto err;
@@ -228,98 +505,47 @@ mbed_error_t send_appid_metadata(int msq, uint8_t  *appid, fidostorage_appid_slo
     }
     /* or sending 'exists' status */
     msgbuf.mtext.u8[0] = 0xff;
-    if (unlikely(msgsnd(msq, &msgbuf, 1, 0) == -1)) {
+    if (unlikely(u2f2_msgsnd(msq, &msgbuf, 1, 0) == -1)) {
         log_printf("[u2f2] failure while sending metadata status, errno=%d\n", errno);
         errcode = MBED_ERROR_UNKNOWN;
         goto err;
     }
 
-    /* sending name */
-    msgbuf.mtype = MAGIC_APPID_METADATA_NAME;
-    msg_len = strlen((char*)appid_info->name);
-    memcpy(&msgbuf.mtext.c[0], appid_info->name, msg_len);
-    msgbuf.mtext.c[msg_len] = '\0';
-    if (unlikely(msgsnd(msq, &msgbuf, msg_len + 1, 0) == -1)) {
-        log_printf("[u2f2] failure while sending metadata name, errno=%d\n", errno);
-        errcode = MBED_ERROR_UNKNOWN;
-        goto err;
-    }
-    /* sending CTR */
-    msgbuf.mtype = MAGIC_APPID_METADATA_CTR;
-    msgbuf.mtext.u32[0] = appid_info->ctr;
-    if (unlikely(msgsnd(msq, &msgbuf, 4, 0) == -1)) {
-        log_printf("[u2f2] failure while sending metadata CTR, errno=%d\n", errno);
-        errcode = MBED_ERROR_UNKNOWN;
-        goto err;
-    }
-    /* sending flags */
-    msgbuf.mtype = MAGIC_APPID_METADATA_FLAGS;
-    msgbuf.mtext.u32[0] = appid_info->flags;
-    if (unlikely(msgsnd(msq, &msgbuf, 4, 0) == -1)) {
-        log_printf("[u2f2] failure while sending metadata flags, errno=%d\n", errno);
-        errcode = MBED_ERROR_UNKNOWN;
-        goto err;
+    /* sending metadata fields */
+#define X(msg_type, field, kind, wtype, wlen, icon_type) \
+    if (U2F2_FIELD_APPLIES(appid_info, icon_type)) { \
+        msgbuf.mtype = U2F2_STREAM_MTYPE(msg_type, sid); \
+        msg_len = U2F2_ENCODE_##kind(&msgbuf, appid_info, field, wtype, wlen); \
+        if (unlikely(u2f2_msgsnd(msq, &msgbuf, msg_len, 0) == -1)) { \
+            log_printf("[u2f2] failure while sending metadata " #field ", errno=%d\n", errno); \
+            errcode = MBED_ERROR_UNKNOWN; \
+            goto err; \
+        } \
     }
+    U2F2_METADATA_FIELDS(X)
+#undef X
 
-    /* sending icon type */
-    msgbuf.mtype = MAGIC_APPID_METADATA_ICON_TYPE;
-    msgbuf.mtext.u16[0] = appid_info->icon_type;
-    if (unlikely(msgsnd(msq, &msgbuf, 2, 0) == -1)) {
-        log_printf("[u2f2] failure while sending metadata icon type, errno=%d\n", errno);
-        errcode = MBED_ERROR_UNKNOWN;
-        goto err;
-    }
-
-    switch (appid_info->icon_type) {
-        case ICON_TYPE_NONE:
-            /* finished here */
-            goto end;
-            break;
-        case ICON_TYPE_COLOR:
-            msgbuf.mtype = MAGIC_APPID_METADATA_COLOR;
-            memcpy(&msgbuf.mtext.u8[0], &appid_info->icon.rgb_color[0], 3);
-            if (unlikely(msgsnd(msq, &msgbuf, 3, 0) == -1)) {
-                log_printf("[u2f2] failure while sending metadata icon color, errno=%d\n", errno);
+#if CONFIG_USR_LIB_U2F2_ICON_IMAGE
+    if (appid_info->icon_type == ICON_TYPE_IMAGE && appid_info->icon_len > 0) {
+        /* then icon data */
+        uint16_t offset = 0;
+        msgbuf.mtype = U2F2_STREAM_MTYPE(MAGIC_APPID_METADATA_ICON, sid);
+        while (offset < appid_info->icon_len) {
+            size_t to_copy = ((size_t)(appid_info->icon_len - offset) < sizeof(msg_mtext_union_t)) ? (size_t)(appid_info->icon_len - offset): sizeof(msg_mtext_union_t);
+            memcpy(&msgbuf.mtext.u8[0], &appid_icon[offset], to_copy);
+            if (unlikely(u2f2_msgsnd(msq, &msgbuf, to_copy, 0) == -1)) {
+                log_printf("[u2f2] failure while sending metadata icon chunk, errno=%d\n", errno);
                 errcode = MBED_ERROR_UNKNOWN;
                 goto err;
             }
-            break;
-        case ICON_TYPE_IMAGE:
-            if (appid_icon == NULL) {
-                log_printf("[u2f2] an icon is to be sent, but icon arg is NULL!\n");
-                errcode = MBED_ERROR_INVPARAM;
-                goto err;
-            }
-            /* sending icon size first */
-            msgbuf.mtype = MAGIC_APPID_METADATA_ICON_START;
-            msgbuf.mtext.u16[0] = appid_info->icon_len;
-            // XXX:
-            if (unlikely(msgsnd(msq, &msgbuf, 2, 0) == -1)) {
-                log_printf("[u2f2] failure while sending metadata icon start, errno=%d\n", errno);
-                errcode = MBED_ERROR_UNKNOWN;
-                goto err;
-            }
-            /* then icon data */
-            uint16_t offset = 0;
-            msgbuf.mtype = MAGIC_APPID_METADATA_ICON;
-            while (offset < appid_info->icon_len) {
-                size_t to_copy = ((appid_info->icon_len - offset) < 64) ? (appid_info->icon_len - offset): 64;
-                memcpy(&msgbuf.mtext.u8[0], &appid_icon[offset], to_copy);
-                if (unlikely(msgsnd(msq, &msgbuf, to_copy, 0) == -1)) {
-                    log_printf("[u2f2] failure while sending metadata icon chunk, errno=%d\n", errno);
-                    errcode = MBED_ERROR_UNKNOWN;
-                    goto err;
-                }
-                offset += to_copy;
-            }
-            break;
-        default:
-            break;
+            offset += to_copy;
+        }
     }
+#endif
 end:
     msg_len = 0;
-    msgbuf.mtype = MAGIC_APPID_METADATA_END;
-    if (unlikely((len = msgsnd(msq, &msgbuf, msg_len, 0)) == -1)) {
+    msgbuf.mtype = U2F2_STREAM_MTYPE(MAGIC_APPID_METADATA_END, sid);
+    if (unlikely((len = u2f2_msgsnd(msq, &msgbuf, msg_len, 0)) == -1)) {
         log_printf("[u2f2] failure while sending metadata end, errno=%d\n", errno);
         errcode = MBED_ERROR_UNKNOWN;
         goto err;
@@ -329,6 +555,13 @@ err:
     return errcode;
 }
 
+mbed_error_t send_appid_metadata(int msq, uint8_t  *appid, fidostorage_appid_slot_t *appid_info, uint8_t    *appid_icon)
+{
+    u2f2_storage_session_t session;
+    u2f2_storage_session_init(&session, msq, NULL, 0);
+    return send_appid_metadata_r(&session, appid, appid_info, appid_icon);
+}
+
 
 /*
  * we have received a MAGIC_STORAGE_SET_METADATA command, with appid inside
@@ -355,74 +588,83 @@ err:
  * <------------ MAGIC_APPID_METADATA_END
  *
  */
-mbed_error_t set_appid_metadata(__in  const int msq,
-                                __in  const u2f2_set_metadata_mode_t mode,
-                                __out uint8_t   *buf,
-                                __in  size_t    buf_len)
+/*
+ * set_appid_metadata implementation. mt is a buf_len bytes buffer. If stream is NULL, mt
+ * holds the whole slot, icon included, and the slot is committed with libfidostorage.
+ * Otherwise, mt holds only the slot header, icon chunks and commit being handled by the
+ * stream hooks.
+ */
+static mbed_error_t set_appid_metadata_core(u2f2_storage_session_t *session,
+                                            const u2f2_set_metadata_mode_t mode,
+                                            fidostorage_appid_slot_t *mt,
+                                            size_t buf_len,
+                                            const u2f2_set_metadata_stream_hooks_t *stream)
 {
     mbed_error_t errcode = MBED_ERROR_NONE;
     struct msgbuf msgbuf = { 0 };
     size_t msg_len = 0;
     ssize_t len;
     uint32_t slotid = 0;
+    bool stream_started = false;
+    bool icon_staged = false;
 
-    /* sanitize */
-    if (buf == NULL) {
-        errcode = MBED_ERROR_INVPARAM;
-        goto err;
-    }
-    if (buf_len < sizeof(fidostorage_appid_slot_t)) {
-        errcode = MBED_ERROR_INVPARAM;
-        goto err;
-    }
+    int msq = session->msq;
+    uint8_t sid = session->stream_id;
 
+    stream_drain_dead(session);
     msg_len = 64;
     /* get back appid/kh identifiers */
-    if (unlikely((len = msgrcv(msq, &msgbuf, msg_len, MAGIC_APPID_METADATA_IDENTIFIERS, 0)) == -1)) {
+    if (unlikely((len = u2f2_msgrcv(msq, &msgbuf, msg_len, U2F2_STREAM_MTYPE(MAGIC_APPID_METADATA_IDENTIFIERS, sid), 0)) == -1)) {
         log_printf("[u2f2] failure while receiving metadata status, errno=%d\n", errno);
         errcode = MBED_ERROR_UNKNOWN;
         goto err;
     }
     if (unlikely(len != 64)) {
-        log_printf("[u2f2] received metadata identifiers have invalid size! (%d instead of %d)\n", len, 64);
+        log_printf("[u2f2] received metadata identifiers have invalid size! (%d instead of %d)\n", (int)len, 64);
         errcode = MBED_ERROR_UNKNOWN;
         goto err;
     }
+    stream_started = true;
     uint8_t *appid = &msgbuf.mtext.u8[0];
     uint8_t *kh = &msgbuf.mtext.u8[32];
-    fidostorage_appid_slot_t *mt = (fidostorage_appid_slot_t*)&buf[0];
 
-    if (unlikely((errcode = fidostorage_fetch_shadow_bitmap()) != MBED_ERROR_NONE)) {
+    if (stream == NULL && unlikely((errcode = fidostorage_fetch_shadow_bitmap()) != MBED_ERROR_NONE)) {
         log_printf("[u2f2] failed to fetch shadow bitmap\n");
         goto err;
     }
 
     /* if mode == templated, get back existing content from template first */
     if (mode == STORAGE_MODE_NEW_FROM_TEMPLATE) {
-        static uint8_t template_kh[32] = { 0 };
-        static uint8_t template_hmac[32] = { 0 };
-        uint32_t slotid = 0;
-        if (unlikely(errcode = fidostorage_get_appid_slot(appid, template_kh, &slotid, template_hmac, NULL, false)) != MBED_ERROR_NONE) {
-            log_printf("[u2f2] requested templated set do not have existing template! leaving\n");
-            goto err;
+        uint8_t *template_kh = &session->template_kh[0];
+        uint8_t *template_hmac = &session->template_hmac[0];
+        /* any slot of appid: the previous template kh and hmac are not to be looked up */
+        memset(template_kh, 0x0, 32);
+        memset(template_hmac, 0x0, 32);
+        if (stream != NULL) {
+            handler_sanity_check_with_panic((physaddr_t)stream->read_header);
+            errcode = stream->read_header(mode, appid, NULL, mt, &slotid);
+        } else {
+            errcode = resolve_appid_slot(session, appid, template_kh, false, template_hmac, &slotid, mt);
         }
-        if (unlikely(errcode = fidostorage_get_appid_metadata(appid, template_kh, slotid, template_hmac, mt)) != MBED_ERROR_NONE) {
-            log_printf("[u2f2] failed to get back template metadata for requested appid!\n");
+        if (unlikely(errcode != MBED_ERROR_NONE)) {
+            log_printf("[u2f2] requested templated set do not have existing template! leaving\n");
             goto err;
         }
     } else if (mode == STORAGE_MODE_NEW_FROM_SCRATCH) {
         /* if built from scratch, clearing the buffer with zeros */
-        memset(buf, 0x0, sizeof(fidostorage_appid_slot_t));
+        memset(mt, 0x0, buf_len);
         /* the appid need to be copied when from scratch */
         memcpy(mt->appid, appid, 32);
     } else if (mode == STORAGE_MODE_UPDATE_EXISTING) {
         /* here we get back the existing slot (including kh) */
-        if (unlikely((errcode = fidostorage_get_appid_slot(appid, kh, &slotid, NULL, NULL, false)) != MBED_ERROR_NONE)) {
-            log_printf("[u2f2] requested existing slot not found! leaving\n");
-            goto err;
+        if (stream != NULL) {
+            handler_sanity_check_with_panic((physaddr_t)stream->read_header);
+            errcode = stream->read_header(mode, appid, kh, mt, &slotid);
+        } else {
+            errcode = resolve_appid_slot(session, appid, kh, true, NULL, &slotid, mt);
         }
-        if (unlikely(errcode = fidostorage_get_appid_metadata(appid, kh, slotid, NULL, mt)) != MBED_ERROR_NONE) {
-            log_printf("[u2f2] failed to get back existing slot metadatas!\n");
+        if (unlikely(errcode != MBED_ERROR_NONE)) {
+            log_printf("[u2f2] requested existing slot not found! leaving\n");
             goto err;
         }
     }
@@ -430,106 +672,123 @@ mbed_error_t set_appid_metadata(__in  const int msq,
     memcpy(mt->kh, kh, 32);
 
     bool transmission_finished = false;
+    uint8_t stream_idx = 0;
+#if CONFIG_USR_LIB_U2F2_ICON_IMAGE
     uint16_t offset = 0;
-    msg_len = 64;
+    bool icon_started = false;
+#endif
+    msg_len = sizeof(msg_mtext_union_t);
     /* from now on, we can receive various requests (at least one), waiting for the MAGIC_APPID_METADATA_END request */
     do {
-        if (unlikely((len = msgrcv(msq, &msgbuf, msg_len, 0, 0)) == -1)) {
+        if (session->prio != NULL && session->prio->deferred_num < CONFIG_USR_LIB_U2F2_PRIO_DEFERRED_DEPTH) {
+            /* any control signal received can be deferred */
+            len = u2f2_msgrcv(msq, &msgbuf, msg_len, 0, 0);
+        } else {
+            /* control signals can't be kept: they are left in the queue */
+            len = stream_recv(session, &msgbuf, msg_len, sid, &stream_idx);
+        }
+        if (unlikely(len == -1)) {
             log_printf("[u2f2] failure while receiving message, errno=%d\n", errno);
             errcode = MBED_ERROR_UNKNOWN;
             goto err;
         }
-        switch (msgbuf.mtype) {
+        if (U2F2_IS_STREAM_MTYPE(msgbuf.mtype) && U2F2_STREAM_ID(msgbuf.mtype) != sid) {
+            /* leftover of a dead stream */
+            log_printf("[u2f2] dropping message %x of stream %d\n", (uint32_t)msgbuf.mtype, U2F2_STREAM_ID(msgbuf.mtype));
+            continue;
+        }
+        if (u2f2_msg_priority(msgbuf.mtype) == U2F2_PRIO_HIGH) {
+            /* control signal received in the middle of the stream: not part of it, handled
+             * by the task once the stream is finished. There is room for it, see above. */
+            u2f2_prio_defer(session->prio, &msgbuf, len);
+            continue;
+        }
+        switch (U2F2_IS_STREAM_MTYPE(msgbuf.mtype) ? U2F2_STREAM_BASE(msgbuf.mtype) : (uint32_t)msgbuf.mtype) {
             case MAGIC_APPID_METADATA_END:
                 /* end of transmission, we can commit and leave now */
                 transmission_finished = true;
                 break;
 
-            case MAGIC_APPID_METADATA_NAME:
-                if (len > 59) { len = 59; } /* truncate len to max name len in mt */
-                memset(&mt->name[0], 0x0, 60);
-                memcpy(&mt->name[0], &msgbuf.mtext.u8[0], len);
-                break;
-
-            case MAGIC_APPID_METADATA_CTR:
-                if (len != 4) {
-                    log_printf("[u2f2] received CTR len is invalid (%d len)\n", len);
-                    continue;
-                }
-                mt->ctr = msgbuf.mtext.u32[0];
+#define X(msg_type, field, kind, wtype, wlen, icon_type) \
+            case (msg_type): \
+                if (!U2F2_FIELD_APPLIES(mt, icon_type)) { \
+                    log_printf("[u2f2] received " #field " while icon_type is not. ignoring.\n"); \
+                    continue; \
+                } \
+                if (!U2F2_DECODE_##kind(&msgbuf, len, mt, field, wtype, wlen)) { \
+                    log_printf("[u2f2] received " #field " len is invalid (%d len)\n", (int)len); \
+                    continue; \
+                } \
                 break;
+            U2F2_METADATA_FIELDS(X)
+#undef X
 
-            case MAGIC_APPID_METADATA_FLAGS:
-                if (len != 4) {
-                    log_printf("[u2f2] received flags len is invalid (%d len)\n", len);
-                    continue;
-                }
-                mt->flags = msgbuf.mtext.u32[0];
-                break;
-
-            case MAGIC_APPID_METADATA_ICON_TYPE:
-                if (len != 2) {
-                    log_printf("[u2f2] received icon_type len is invalid (%d len)\n", len);
-                    continue;
-                }
-                mt->icon_type = msgbuf.mtext.u16[0];
-                break;
-
-            case MAGIC_APPID_METADATA_COLOR:
-                if (mt->icon_type != ICON_TYPE_COLOR) {
-                    log_printf("[u2f2] received color while icon_type is not. ignoring.\n");
-                    continue;
-                }
-                if (len != 3) {
-                    /* invalid CTR len ! ignoring */
-                    log_printf("[u2f2] received color len is invalid (%d len)\n", len);
-                    continue;
-                }
-                memcpy(&mt->icon.rgb_color[0], &msgbuf.mtext.u8[0], 3);
-                break;
-
-            case MAGIC_APPID_METADATA_ICON_START:
+#if CONFIG_USR_LIB_U2F2_ICON_IMAGE
+            case MAGIC_APPID_METADATA_ICON:
                 if (mt->icon_type != ICON_TYPE_IMAGE) {
                     log_printf("[u2f2] received image while icon_type is not. ignoring.\n");
                     continue;
                 }
-                if (len != 2) {
-                    /* invalid CTR len ! ignoring */
-                    log_printf("[u2f2] received icon len is invalid (%d len)\n", len);
-                    continue;
-                }
-                mt->icon_len = msgbuf.mtext.u16[0];
-                /* here, we must check again buf len */
-                uint32_t requested_size = (sizeof(fidostorage_appid_slot_t) - sizeof(fidostorage_icon_data_t) + mt->icon_len);
-                if (buf_len < requested_size) {
-                    log_printf("[u2f2] not enough space in buffer (%d len) for requested size (%d)\n", buf_len, requested_size);
-                    mt->icon_len = 0;
+                if (!icon_started) {
+                    /* the icon len, hence the chunks checks, are only known from ICON_START */
+                    log_printf("[u2f2] received icon data before icon start!\n");
+                    errcode = MBED_ERROR_INVPARAM;
                     goto err;
                 }
-                break;
-
-            case MAGIC_APPID_METADATA_ICON:
-                if (mt->icon_type != ICON_TYPE_IMAGE) {
-                    log_printf("[u2f2] received image while icon_type is not. ignoring.\n");
-                    continue;
-                }
                 if ((offset + len) > mt->icon_len) {
                     log_printf("[u2f2] overflowed icon len, ignoring!");
                     continue;
                 }
-                memcpy(&mt->icon.icon_data[offset], &msgbuf.mtext.u8[0], len);
+                if (stream != NULL) {
+                    /* written through to the staged slot */
+                    handler_sanity_check_with_panic((physaddr_t)stream->stage_icon);
+                    if (unlikely((errcode = stream->stage_icon(offset, &msgbuf.mtext.u8[0], len)) != MBED_ERROR_NONE)) {
+                        log_printf("[u2f2] failed to stage icon chunk!\n");
+                        goto err;
+                    }
+                    icon_staged = true;
+                } else {
+                    memcpy(&mt->icon.icon_data[offset], &msgbuf.mtext.u8[0], len);
+                }
                 offset += len;
                 break;
+#endif
 
             default:
-                printf("[u2f2] unknown mtype %d while handling set_metadata\n", msgbuf.mtype);
+                log_printf("[u2f2] unknown mtype %x while handling set_metadata\n", (uint32_t)msgbuf.mtype);
                 errcode = MBED_ERROR_UNKNOWN;
                 goto err;
                 break;
         }
+#if CONFIG_USR_LIB_U2F2_ICON_IMAGE
+        if (msgbuf.mtype == U2F2_STREAM_MTYPE(MAGIC_APPID_METADATA_ICON_START, sid)) {
+            /* here, we must check again buf len (the whole icon is kept in buffer unless streamed) */
+            uint32_t requested_size = (sizeof(fidostorage_appid_slot_t) - sizeof(fidostorage_icon_data_t) + mt->icon_len);
+            if (mt->icon_len > sizeof(fidostorage_icon_data_t) || (stream == NULL && buf_len < requested_size)) {
+                log_printf("[u2f2] not enough space in buffer (%d len) for requested size (%d)\n", (int)buf_len, (int)requested_size);
+                mt->icon_len = 0;
+                errcode = MBED_ERROR_NOMEM;
+                goto err;
+            }
+            /* the icon is fully (re)sent */
+            icon_started = true;
+            offset = 0;
+        }
+#endif
     } while (!transmission_finished);
 
+#if CONFIG_USR_LIB_U2F2_ICON_IMAGE
+    if (icon_started && mt->icon_type == ICON_TYPE_IMAGE && offset != mt->icon_len) {
+        /* truncated icon: neither partially (re)written data nor the previous icon are
+         * to be committed under the new icon len */
+        log_printf("[u2f2] icon truncated (%d bytes received instead of %d)!\n", offset, mt->icon_len);
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+#endif
+
     /* metadata are now fully set, we can write it back. */
+    uint32_t src_slotid = slotid;
     if ((mode == STORAGE_MODE_NEW_FROM_TEMPLATE) || (mode == STORAGE_MODE_NEW_FROM_SCRATCH)) {
         /* here we need a new slotid, for a new slot content */
         /* NOTE: fidostorage_set_appid_metadata will allocate it */
@@ -539,11 +798,453 @@ mbed_error_t set_appid_metadata(__in  const int msq,
     }
 
     /* writing the metadata back to the slotid */
-    if (unlikely((errcode = fidostorage_set_appid_metadata(&slotid, mt, false)) != MBED_ERROR_NONE)) {
+    if (stream != NULL) {
+        handler_sanity_check_with_panic((physaddr_t)stream->commit);
+        errcode = stream->commit(&slotid, src_slotid, mt, icon_staged);
+    } else {
+        errcode = fidostorage_set_appid_metadata(&slotid, mt, false);
+    }
+    if (unlikely(errcode != MBED_ERROR_NONE)) {
         log_printf("[u2f2] failed to commit changes!\n");
         goto err;
     }
+    /* the slot content (hence its hmac) has changed */
+    if (session->slot_cache != NULL) {
+        u2f2_slot_cache_insert(session->slot_cache, mt->appid, mt->kh, NULL, slotid);
+    }
+
+err:
+    if (errcode != MBED_ERROR_NONE && stream_started) {
+        if (stream != NULL) {
+            /* nothing is committed, the staged slot is dropped */
+            handler_sanity_check_with_panic((physaddr_t)stream->abort);
+            stream->abort();
+        }
+        /* broken stream, its leftovers are not to be read by the next request */
+        u2f2_stream_resync(session, session->stream_id, CONFIG_USR_LIB_U2F2_RESYNC_MAX_MSGS);
+    }
+    return errcode;
+}
+
+mbed_error_t set_appid_metadata_r(__in  u2f2_storage_session_t *session,
+                                  __in  const u2f2_set_metadata_mode_t mode,
+                                  __out uint8_t   *buf,
+                                  __in  size_t    buf_len)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+
+    /* sanitize */
+    if (session == NULL || buf == NULL) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+    if (buf_len < sizeof(fidostorage_appid_slot_t)) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+    errcode = set_appid_metadata_core(session, mode, (fidostorage_appid_slot_t*)&buf[0], buf_len, NULL);
+err:
+    return errcode;
+}
+
+mbed_error_t set_appid_metadata_stream_r(__in  u2f2_storage_session_t *session,
+                                         __in  const u2f2_set_metadata_mode_t mode,
+                                         __in  const u2f2_set_metadata_stream_hooks_t *hooks)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    /* only the slot header is kept in RAM */
+    uint32_t header[(U2F2_APPID_SLOT_HEADER_LEN + sizeof(uint32_t) - 1) / sizeof(uint32_t)];
 
+    /* sanitize */
+    if (session == NULL || hooks == NULL) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+    if (hooks->read_header == NULL || hooks->stage_icon == NULL || hooks->commit == NULL || hooks->abort == NULL) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+    errcode = set_appid_metadata_core(session, mode, (fidostorage_appid_slot_t*)&header[0], U2F2_APPID_SLOT_HEADER_LEN, hooks);
 err:
     return errcode;
 }
+
+mbed_error_t set_appid_metadata(__in  const int msq,
+                                __in  const u2f2_set_metadata_mode_t mode,
+                                __out uint8_t   *buf,
+                                __in  size_t    buf_len)
+{
+    u2f2_storage_session_t session;
+    u2f2_storage_session_init(&session, msq, NULL, 0);
+    return set_appid_metadata_r(&session, mode, buf, buf_len);
+}
+
+
+/*
+ * Fused user presence request: the appid is sent along with the presence request,
+ * the backend responds with the appid metadata stream (as for MAGIC_STORAGE_GET_METADATA)
+ * and then with the user presence result, saving a full request/response cycle.
+ *
+ * <------------ MAGIC_USER_PRESENCE_METADATA_REQ (appid: u8[32])
+ * ------------> MAGIC_APPID_METADATA_STATUS
+ *  ... (metadata stream, see request_appid_metada())
+ * ------------> MAGIC_APPID_METADATA_END
+ * ------------> MAGIC_USER_PRESENCE_ACK (result: u8, 0xff if user is present)
+ */
+mbed_error_t request_user_presence_with_metadata_r(u2f2_storage_session_t *session, uint8_t *appid, fidostorage_appid_slot_t *appid_info, uint8_t **appid_icon_p, bool *user_present)
+{
+    log_printf("%s\n", __func__);
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    if (session == NULL || appid == NULL || appid_info == NULL || appid_icon_p == NULL || user_present == NULL) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+    struct msgbuf msgbuf = { 0 };
+    size_t msg_len = 0;
+    ssize_t len;
+    int msq = session->msq;
+
+    *user_present = false;
+    memcpy(appid_info->appid, appid, 32);
+    /* sending fused request */
+    msgbuf.mtype = MAGIC_USER_PRESENCE_METADATA_REQ;
+    memcpy(&msgbuf.mtext.u8[0], appid, 32);
+    if (unlikely(u2f2_msgsnd(msq, &msgbuf, set_request_stream_id(session, &msgbuf, 32), 0) == -1)) {
+        log_printf("[u2f2] failure while sending presence request, errno=%d\n", errno);
+        errcode = MBED_ERROR_UNKNOWN;
+        goto err;
+    }
+    /* metadata stream first. An unknown appid is not a failure here: the user presence
+     * is still requested, the UI simply has nothing to display */
+    errcode = recv_appid_metadata(session, appid_info, appid_icon_p);
+    if (errcode != MBED_ERROR_NONE && errcode != MBED_ERROR_NOSTORAGE) {
+        u2f2_stream_resync(session, session->stream_id, CONFIG_USR_LIB_U2F2_RESYNC_MAX_MSGS);
+        goto err;
+    }
+    /* then user presence result */
+    msg_len = 1;
+    if (unlikely((len = u2f2_msgrcv(msq, &msgbuf, msg_len, MAGIC_USER_PRESENCE_ACK, 0)) == -1)) {
+        log_printf("[u2f2] failure while receiving presence result, errno=%d\n", errno);
+        errcode = MBED_ERROR_UNKNOWN;
+        goto err;
+    }
+    if (len != 1) {
+        /* no result, handled as user absence */
+        log_printf("[u2f2] received presence result has invalid size! (%d instead of 1)\n", (int)len);
+        errcode = MBED_ERROR_UNKNOWN;
+        goto err;
+    }
+    *user_present = (msgbuf.mtext.u8[0] == 0xff);
+err:
+    return errcode;
+}
+
+mbed_error_t request_user_presence_with_metadata(int msq, uint8_t *appid, fidostorage_appid_slot_t *appid_info, uint8_t **appid_icon_p, bool *user_present)
+{
+    u2f2_storage_session_t session;
+    u2f2_storage_session_init(&session, msq, NULL, 0);
+    return request_user_presence_with_metadata_r(&session, appid, appid_info, appid_icon_p, user_present);
+}
+
+/*
+ * here, MAGIC_USER_PRESENCE_METADATA_REQ has just been received from msq and appid stored in argument.
+ * The metadata stream is sent, so that the remote can render its prompt, then the hook is
+ * executed to get back the user presence, which is finally sent back.
+ */
+mbed_error_t send_appid_metadata_with_presence_r(u2f2_storage_session_t *session, uint8_t *appid, fidostorage_appid_slot_t *appid_info, uint8_t *appid_icon, u2f2_user_presence_hook_t hook)
+{
+    log_printf("%s\n", __func__);
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    struct msgbuf msgbuf = { 0 };
+    bool user_present = false;
+
+    if (session == NULL) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+    /* from now on, the requester is always answered, failures being handled as user absence */
+    int msq = session->msq;
+    if (unlikely((errcode = send_appid_metadata_r(session, appid, appid_info, appid_icon)) != MBED_ERROR_NONE)) {
+        log_printf("[u2f2] failed to send metadata, answering user absence\n");
+        if (errcode == MBED_ERROR_INVPARAM) {
+            /* nothing sent yet: the appid is reported as unknown, so that the requester
+             * gets to the presence result */
+            uint8_t unknown_appid[32] = { 0 };
+            send_appid_metadata_r(session, unknown_appid, NULL, NULL);
+        }
+        goto ack;
+    }
+    if (hook == NULL) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto ack;
+    }
+    handler_sanity_check_with_panic((physaddr_t)hook);
+    if (hook(&user_present) != MBED_ERROR_NONE) {
+        /* hook failure is handled as user absence, the requester must not be left waiting */
+        user_present = false;
+    }
+ack:
+    msgbuf.mtype = MAGIC_USER_PRESENCE_ACK;
+    msgbuf.mtext.u8[0] = user_present ? 0xff : 0x00;
+    if (unlikely(u2f2_msgsnd(msq, &msgbuf, 1, 0) == -1)) {
+        log_printf("[u2f2] failure while sending presence result, errno=%d\n", errno);
+        errcode = MBED_ERROR_UNKNOWN;
+        goto err;
+    }
+err:
+    return errcode;
+}
+
+mbed_error_t send_appid_metadata_with_presence(int msq, uint8_t *appid, fidostorage_appid_slot_t *appid_info, uint8_t *appid_icon, u2f2_user_presence_hook_t hook)
+{
+    u2f2_storage_session_t session;
+    u2f2_storage_session_init(&session, msq, NULL, 0);
+    return send_appid_metadata_with_presence_r(&session, appid, appid_info, appid_icon, hook);
+}
+
+
+/*
+ * Batched appid lookup: the candidates are resolved in one exchange, only the selected one
+ * (the first existing candidate) being responded with its full metadata. Candidates are
+ * sent by chunks of 7, each chunk being answered before the next one is sent, so that
+ * none of the peers is ever blocked in msgsnd() while the other one is too.
+ * The backend always answers, unresolved candidates being reported as non-existent.
+ *
+ * <------------ MAGIC_STORAGE_LOOKUP_METADATA (num: u8)
+ * <------------ MAGIC_APPID_LOOKUP_CANDIDATE (appid,kh)
+ *  ... (up to 7 candidates)
+ * ------------> MAGIC_APPID_LOOKUP_RESULT (exists bitmap: u32, (ctr,flags): u32[2] * 7)
+ *  ... (next chunks)
+ * <------------ MAGIC_APPID_LOOKUP_CANDIDATE (appid,kh)
+ * ------------> MAGIC_APPID_LOOKUP_RESULT
+ * ------------> MAGIC_APPID_METADATA_STATUS
+ *  ... (metadata stream of the selected candidate, see request_appid_metada())
+ * ------------> MAGIC_APPID_METADATA_END
+ */
+
+/* number of candidate results per MAGIC_APPID_LOOKUP_RESULT message */
+#define U2F2_LOOKUP_RESULTS_PER_MSG 7
+
+static inline size_t lookup_result_msg_len(uint8_t entries)
+{
+    return sizeof(uint32_t) + (entries * 2 * sizeof(uint32_t));
+}
+
+mbed_error_t request_appid_lookup_r(u2f2_storage_session_t *session, const u2f2_lookup_candidate_t *candidates, uint8_t num, u2f2_lookup_result_t *results, uint8_t *selected, fidostorage_appid_slot_t *appid_info, uint8_t **appid_icon_p)
+{
+    log_printf("%s\n", __func__);
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    struct msgbuf msgbuf = { 0 };
+    ssize_t len;
+    bool stream_started = false;
+
+    if (session == NULL || candidates == NULL || results == NULL || selected == NULL || appid_info == NULL || appid_icon_p == NULL) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+    if (num == 0 || num == U2F2_LOOKUP_NONE) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+    for (uint8_t i = 0; i < num; ++i) {
+        if (candidates[i].appid == NULL || candidates[i].kh == NULL) {
+            errcode = MBED_ERROR_INVPARAM;
+            goto err;
+        }
+    }
+    int msq = session->msq;
+    *selected = U2F2_LOOKUP_NONE;
+
+    /* sending lookup request, then the candidates */
+    msgbuf.mtype = MAGIC_STORAGE_LOOKUP_METADATA;
+    msgbuf.mtext.u8[0] = num;
+    if (unlikely(u2f2_msgsnd(msq, &msgbuf, set_request_stream_id(session, &msgbuf, 1), 0) == -1)) {
+        log_printf("[u2f2] failure while sending lookup request, errno=%d\n", errno);
+        errcode = MBED_ERROR_UNKNOWN;
+        goto err;
+    }
+    uint8_t sid = session->stream_id;
+    stream_started = true;
+    /* candidates chunk, then its result vector */
+    for (uint16_t i = 0; i < num; i += U2F2_LOOKUP_RESULTS_PER_MSG) {
+        uint8_t entries = ((num - i) < U2F2_LOOKUP_RESULTS_PER_MSG) ? (num - i) : U2F2_LOOKUP_RESULTS_PER_MSG;
+        msgbuf.mtype = U2F2_STREAM_MTYPE(MAGIC_APPID_LOOKUP_CANDIDATE, sid);
+        for (uint8_t j = 0; j < entries; ++j) {
+            memcpy(&msgbuf.mtext.u8[0], candidates[i + j].appid, 32);
+            memcpy(&msgbuf.mtext.u8[32], candidates[i + j].kh, 32);
+            if (unlikely(u2f2_msgsnd(msq, &msgbuf, 64, 0) == -1)) {
+                log_printf("[u2f2] failure while sending lookup candidate, errno=%d\n", errno);
+                errcode = MBED_ERROR_UNKNOWN;
+                goto err;
+            }
+        }
+        if (unlikely((len = u2f2_msgrcv(msq, &msgbuf, sizeof(msg_mtext_union_t), U2F2_STREAM_MTYPE(MAGIC_APPID_LOOKUP_RESULT, sid), 0)) == -1)) {
+            log_printf("[u2f2] failure while receiving lookup result, errno=%d\n", errno);
+            errcode = MBED_ERROR_UNKNOWN;
+            goto err;
+        }
+        if ((size_t)len != lookup_result_msg_len(entries)) {
+            log_printf("[u2f2] received lookup result has invalid size! (%d)\n", (int)len);
+            errcode = MBED_ERROR_UNKNOWN;
+            goto err;
+        }
+        for (uint8_t j = 0; j < entries; ++j) {
+            u2f2_lookup_result_t *result = &results[i + j];
+            result->exists = (msgbuf.mtext.u32[0] & (1UL << j)) != 0;
+            result->ctr = msgbuf.mtext.u32[1 + (2 * j)];
+            result->flags = msgbuf.mtext.u32[2 + (2 * j)];
+            if (result->exists && *selected == U2F2_LOOKUP_NONE) {
+                *selected = i + j;
+            }
+        }
+    }
+    /* then the selected candidate metadata */
+    if (*selected != U2F2_LOOKUP_NONE) {
+        memcpy(appid_info->appid, candidates[*selected].appid, 32);
+        memcpy(appid_info->kh, candidates[*selected].kh, 32);
+    }
+    errcode = recv_appid_metadata(session, appid_info, appid_icon_p);
+    if (errcode == MBED_ERROR_NOSTORAGE && *selected != U2F2_LOOKUP_NONE) {
+        log_printf("[u2f2] selected candidate metadata not sent!\n");
+        errcode = MBED_ERROR_UNKNOWN;
+        goto err;
+    }
+    if (errcode == MBED_ERROR_NONE && *selected == U2F2_LOOKUP_NONE) {
+        log_printf("[u2f2] metadata sent while no candidate exists!\n");
+        errcode = MBED_ERROR_UNKNOWN;
+        goto err;
+    }
+err:
+    if (errcode != MBED_ERROR_NONE && errcode != MBED_ERROR_NOSTORAGE && stream_started) {
+        /* broken stream, its leftovers are not to be read by the next request */
+        u2f2_stream_resync(session, session->stream_id, CONFIG_USR_LIB_U2F2_RESYNC_MAX_MSGS);
+    }
+    return errcode;
+}
+
+mbed_error_t request_appid_lookup(int msq, const u2f2_lookup_candidate_t *candidates, uint8_t num, u2f2_lookup_result_t *results, uint8_t *selected, fidostorage_appid_slot_t *appid_info, uint8_t **appid_icon_p)
+{
+    u2f2_storage_session_t session;
+    u2f2_storage_session_init(&session, msq, NULL, 0);
+    return request_appid_lookup_r(&session, candidates, num, results, selected, appid_info, appid_icon_p);
+}
+
+mbed_error_t handle_appid_lookup_r(u2f2_storage_session_t *session, const struct msgbuf *msgbuf, size_t len, uint8_t *buf, size_t buf_len)
+{
+    log_printf("%s\n", __func__);
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    struct msgbuf resp = { 0 };
+    struct msgbuf cand = { 0 };
+    ssize_t cand_len;
+    /* identifiers and slot of the selected candidate */
+    uint8_t sel_appid[32] = { 0 };
+    uint8_t sel_kh[32];
+    uint32_t sel_slotid = 0;
+    bool sel_found = false;
+    bool stream_started = false;
+    /* the storage can be used to resolve the candidates */
+    bool storage_ok = true;
+    /* the candidates can still be received */
+    bool cand_ok = true;
+    uint8_t num = 0;
+
+    if (session == NULL || msgbuf == NULL) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+    int msq = session->msq;
+    if (len >= 1) {
+        num = msgbuf->mtext.u8[0];
+    }
+    session->stream_id = u2f2_request_stream_id(msgbuf, len, 1);
+    uint8_t sid = session->stream_id;
+    stream_drain_dead(session);
+    stream_started = true;
+    fidostorage_appid_slot_t *mt = (fidostorage_appid_slot_t*)buf;
+
+    /* from now on, the requester is always answered, even on error */
+    if (num == 0 || num == U2F2_LOOKUP_NONE) {
+        log_printf("[u2f2] invalid lookup candidates number %d\n", num);
+        errcode = MBED_ERROR_INVPARAM;
+        /* no candidate to be received nor answered */
+        num = 0;
+    }
+    if (buf == NULL || buf_len < sizeof(fidostorage_appid_slot_t)) {
+        errcode = MBED_ERROR_INVPARAM;
+        storage_ok = false;
+    } else if (unlikely((errcode = fidostorage_fetch_shadow_bitmap()) != MBED_ERROR_NONE)) {
+        log_printf("[u2f2] failed to fetch shadow bitmap\n");
+        storage_ok = false;
+    }
+    /* candidates are resolved as they are received, the result vector being sent by chunks */
+    resp.mtype = U2F2_STREAM_MTYPE(MAGIC_APPID_LOOKUP_RESULT, sid);
+    uint8_t entries = 0;
+    for (uint8_t i = 0; i < num; ++i) {
+        bool resolvable = storage_ok;
+        if (entries == 0) {
+            memset(&resp.mtext, 0x0, sizeof(msg_mtext_union_t));
+        }
+        if (!cand_ok) {
+            resolvable = false;
+        } else if (unlikely((cand_len = u2f2_msgrcv(msq, &cand, sizeof(msg_mtext_union_t), U2F2_STREAM_MTYPE(MAGIC_APPID_LOOKUP_CANDIDATE, sid), 0)) == -1)) {
+            log_printf("[u2f2] failure while receiving lookup candidate, errno=%d\n", errno);
+            errcode = MBED_ERROR_UNKNOWN;
+            cand_ok = false;
+            resolvable = false;
+        } else if (cand_len != 64) {
+            log_printf("[u2f2] received lookup candidate has invalid size! (%d instead of 64)\n", (int)cand_len);
+            errcode = MBED_ERROR_UNKNOWN;
+            resolvable = false;
+        }
+        uint32_t slotid = 0;
+        /* an unresolved candidate is reported as non-existent */
+        if (resolvable &&
+            resolve_appid_slot(session, &cand.mtext.u8[0], &cand.mtext.u8[32], true, NULL, &slotid, mt) == MBED_ERROR_NONE) {
+            resp.mtext.u32[0] |= (1UL << entries);
+            resp.mtext.u32[1 + (2 * entries)] = mt->ctr;
+            resp.mtext.u32[2 + (2 * entries)] = mt->flags;
+            if (!sel_found) {
+                memcpy(sel_appid, &cand.mtext.u8[0], 32);
+                memcpy(sel_kh, &cand.mtext.u8[32], 32);
+                sel_slotid = slotid;
+                sel_found = true;
+            }
+        }
+        entries++;
+        if (entries == U2F2_LOOKUP_RESULTS_PER_MSG || i == (num - 1)) {
+            if (unlikely(u2f2_msgsnd(msq, &resp, lookup_result_msg_len(entries), 0) == -1)) {
+                log_printf("[u2f2] failure while sending lookup result, errno=%d\n", errno);
+                errcode = MBED_ERROR_UNKNOWN;
+                goto err;
+            }
+            entries = 0;
+        }
+    }
+    /* the selected slot is read back again, mt having been reused by the next candidates */
+    if (sel_found && unlikely(fidostorage_get_appid_metadata(sel_appid, sel_kh, sel_slotid, NULL, mt) != MBED_ERROR_NONE)) {
+        log_printf("[u2f2] failed to read back selected slot\n");
+        sel_found = false;
+    }
+    mbed_error_t send_errcode;
+    if (sel_found) {
+        send_errcode = send_appid_metadata_r(session, sel_appid, mt, &mt->icon.icon_data[0]);
+    } else {
+        send_errcode = send_appid_metadata_r(session, sel_appid, NULL, NULL);
+    }
+    if (errcode == MBED_ERROR_NONE) {
+        errcode = send_errcode;
+    }
+err:
+    if (errcode != MBED_ERROR_NONE && stream_started) {
+        /* broken stream, its leftovers are not to be read by the next request */
+        u2f2_stream_resync(session, session->stream_id, CONFIG_USR_LIB_U2F2_RESYNC_MAX_MSGS);
+    }
+    return errcode;
+}
+
+mbed_error_t handle_appid_lookup(int msq, const struct msgbuf *msgbuf, size_t len, uint8_t *buf, size_t buf_len)
+{
+    u2f2_storage_session_t session;
+    u2f2_storage_session_init(&session, msq, NULL, 0);
+    return handle_appid_lookup_r(&session, msgbuf, len, buf, buf_len);
+}
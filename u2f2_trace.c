@@ -0,0 +1,178 @@
+/*
+ *
+ * Copyright 2019 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * the Free Software Foundation; either version 3 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+#include "api/libu2f2.h"
+#include "libc/string.h"
+#include "libc/stdio.h"
+#include "libc/syscall.h"
+
+#include "u2f2_helpers.h"
+
+#if CONFIG_USR_LIB_U2F2_TRACE
+
+/*
+ * IPC trace capture. Each successful emission and reception of the helpers is recorded
+ * in a ring buffer, the oldest records being overwritten. Payloads are not kept, only
+ * their FNV-1a hash, so that a captured session can be compared against a replay.
+ * The ring is shared by all the sessions of the task: its accesses are serialized by
+ * a spin lock, the helpers not being called from ISR handlers.
+ */
+static struct {
+    u2f2_trace_record_t records[CONFIG_USR_LIB_U2F2_TRACE_DEPTH];
+    uint32_t            count;   /* total records since reset */
+    bool                enabled;
+    bool                lock;
+} u2f2_trace = { 0 };
+
+static inline void trace_lock(void)
+{
+    while (__atomic_test_and_set(&u2f2_trace.lock, __ATOMIC_ACQUIRE)) {
+        continue;
+    }
+}
+
+static inline void trace_unlock(void)
+{
+    __atomic_clear(&u2f2_trace.lock, __ATOMIC_RELEASE);
+}
+
+static uint32_t trace_hash(const uint8_t *data, size_t len)
+{
+    uint32_t hash = 0x811c9dc5UL;
+    for (size_t i = 0; i < len; ++i) {
+        hash ^= data[i];
+        hash *= 0x01000193UL;
+    }
+    return hash;
+}
+
+static void trace_record(u2f2_trace_dir_t dir, int msqid, const struct msgbuf *msgbuf, size_t len)
+{
+    u2f2_trace_record_t *record;
+    uint64_t ts = 0;
+
+    if (!u2f2_trace.enabled) {
+        return;
+    }
+    uint32_t hash = trace_hash(&msgbuf->mtext.u8[0], len);
+    sys_get_systick(&ts, PREC_MICRO);
+    trace_lock();
+    record = &u2f2_trace.records[u2f2_trace.count % CONFIG_USR_LIB_U2F2_TRACE_DEPTH];
+    record->timestamp = ts;
+    record->mtype = (uint32_t)msgbuf->mtype;
+    record->hash = hash;
+    record->msq = msqid;
+    record->len = (uint8_t)len;
+    record->dir = dir;
+    u2f2_trace.count++;
+    trace_unlock();
+}
+
+int u2f2_msgsnd(int msqid, const void *msgp, size_t msgsz, int msgflg)
+{
+    int ret = msgsnd(msqid, msgp, msgsz, msgflg);
+    if (ret != -1) {
+        trace_record(U2F2_TRACE_TX, msqid, (const struct msgbuf*)msgp, msgsz);
+    }
+    return ret;
+}
+
+ssize_t u2f2_msgrcv(int msqid, void *msgp, size_t msgsz, long msgtyp, int msgflg)
+{
+    ssize_t ret = msgrcv(msqid, msgp, msgsz, msgtyp, msgflg);
+    if (ret != -1) {
+        trace_record(U2F2_TRACE_RX, msqid, (const struct msgbuf*)msgp, (size_t)ret);
+    }
+    return ret;
+}
+
+void u2f2_trace_start(void)
+{
+    u2f2_trace.enabled = true;
+}
+
+void u2f2_trace_stop(void)
+{
+    u2f2_trace.enabled = false;
+}
+
+void u2f2_trace_reset(void)
+{
+    trace_lock();
+    u2f2_trace.count = 0;
+    trace_unlock();
+}
+
+static inline uint32_t trace_available(void)
+{
+    return (u2f2_trace.count < CONFIG_USR_LIB_U2F2_TRACE_DEPTH) ? u2f2_trace.count : CONFIG_USR_LIB_U2F2_TRACE_DEPTH;
+}
+
+uint32_t u2f2_trace_count(void)
+{
+    uint32_t count;
+
+    trace_lock();
+    count = trace_available();
+    trace_unlock();
+    return count;
+}
+
+mbed_error_t u2f2_trace_get(uint32_t index, u2f2_trace_record_t *record)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    if (record == NULL) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+    trace_lock();
+    if (index >= trace_available()) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err_unlock;
+    }
+    /* index 0 is the oldest record still in the ring */
+    uint32_t first = u2f2_trace.count - trace_available();
+    memcpy(record, &u2f2_trace.records[(first + index) % CONFIG_USR_LIB_U2F2_TRACE_DEPTH], sizeof(u2f2_trace_record_t));
+err_unlock:
+    trace_unlock();
+err:
+    return errcode;
+}
+
+void u2f2_trace_dump(void)
+{
+    u2f2_trace_record_t record;
+
+    for (uint32_t i = 0; i < u2f2_trace_count(); ++i) {
+        if (u2f2_trace_get(i, &record) != MBED_ERROR_NONE) {
+            break;
+        }
+        /* the timestamp is printed as two 32 bits halves, as the libc printf has no 64 bits format */
+        printf("[u2f2-trace] %x%08x %s %d %x %d %x\n",
+               (uint32_t)(record.timestamp >> 32), (uint32_t)(record.timestamp & 0xffffffffUL),
+               (record.dir == U2F2_TRACE_TX) ? "T" : "R",
+               record.msq, record.mtype, record.len, record.hash);
+    }
+}
+
+#endif
@@ -0,0 +1,241 @@
+/*
+ *
+ * Copyright 2019 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * the Free Software Foundation; either version 3 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+#include "api/libu2f2.h"
+#include "libc/string.h"
+#include "libc/stdio.h"
+
+#include "u2f2_helpers.h"
+
+/*
+ * Unlock session, backend side. The key derivation starts as soon as the PET PIN is
+ * received, and is executed step by step while waiting for the user to confirm the
+ * passphrase and to type the user PIN:
+ *
+ * ------------> MAGIC_PETPIN_INSERT
+ * <------------ MAGIC_PETPIN_INSERTED (pet pin)
+ *                                              | petpin hook
+ * ------------> MAGIC_PASSPHRASE_CONFIRM (passphrase)
+ * <------------ MAGIC_PASSPHRASE_RESULT (u8: 0xff if confirmed)
+ * ------------> MAGIC_USERPIN_INSERT           | derive step hook, up to completion
+ * <------------ MAGIC_USERPIN_INSERTED (user pin)
+ *                                              | userpin hook, once derivation is done
+ * ------------> MAGIC_TOKEN_UNLOCKED
+ */
+
+static mbed_error_t unlock_send(u2f2_unlock_ctx_t *ctx, uint32_t sig, const uint8_t *data, size_t len)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    struct msgbuf msgbuf;
+
+    msgbuf.mtype = sig;
+    if (len > 0) {
+        memcpy(&msgbuf.mtext.u8[0], data, len);
+    }
+    log_printf("%s: send signal %x to %d\n", __func__, sig, ctx->msq);
+    if (unlikely(u2f2_msgsnd(ctx->msq, &msgbuf, len, 0) == -1)) {
+        log_printf("%s: failure while sending, errno=%d\n", __func__, errno);
+        errcode = MBED_ERROR_UNKNOWN;
+    }
+    return errcode;
+}
+
+/*
+ * try to receive the awaited signal. Returns false if not (yet) received.
+ */
+static bool unlock_recv(u2f2_unlock_ctx_t *ctx, uint32_t sig, struct msgbuf *msgbuf, ssize_t *len, bool blocking)
+{
+    *len = u2f2_msgrcv(ctx->msq, msgbuf, sizeof(msg_mtext_union_t), sig, blocking ? 0 : IPC_NOWAIT);
+    if (*len == -1) {
+        return false;
+    }
+    log_printf("%s: receiving signal %x from %d\n", __func__, sig, ctx->msq);
+    return true;
+}
+
+mbed_error_t u2f2_unlock_init(u2f2_unlock_ctx_t *ctx, int msq, const u2f2_unlock_hooks_t *hooks)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    if (ctx == NULL || hooks == NULL) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+    if (hooks->petpin == NULL || hooks->derive_step == NULL || hooks->userpin == NULL) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+    memset(ctx, 0x0, sizeof(u2f2_unlock_ctx_t));
+    ctx->msq = msq;
+    ctx->hooks = *hooks;
+    ctx->state = U2F2_UNLOCK_INIT;
+err:
+    return errcode;
+}
+
+mbed_error_t u2f2_unlock_step(u2f2_unlock_ctx_t *ctx, bool blocking)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    struct msgbuf msgbuf;
+    uint8_t passphrase[sizeof(msg_mtext_union_t)];
+    ssize_t len = 0;
+    bool progress = false;
+
+    if (ctx == NULL) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+    switch (ctx->state) {
+        case U2F2_UNLOCK_INIT:
+            if (unlikely((errcode = unlock_send(ctx, MAGIC_PETPIN_INSERT, NULL, 0)) != MBED_ERROR_NONE)) {
+                goto failed;
+            }
+            ctx->state = U2F2_UNLOCK_WAIT_PETPIN;
+            progress = true;
+            break;
+
+        case U2F2_UNLOCK_WAIT_PETPIN: {
+            size_t passphrase_len = sizeof(passphrase);
+            if (!unlock_recv(ctx, MAGIC_PETPIN_INSERTED, &msgbuf, &len, blocking)) {
+                break;
+            }
+            /* the petpin hook checks the PET PIN, gets back the passphrase and initiates the
+             * key derivation */
+            handler_sanity_check_with_panic((physaddr_t)ctx->hooks.petpin);
+            errcode = ctx->hooks.petpin(&msgbuf.mtext.u8[0], len, passphrase, &passphrase_len);
+            memset(&msgbuf, 0x0, sizeof(msgbuf));
+            if (errcode != MBED_ERROR_NONE || passphrase_len > sizeof(passphrase)) {
+                log_printf("%s: PET PIN refused\n", __func__);
+                goto failed;
+            }
+            ctx->derive_started = true;
+            if (unlikely((errcode = unlock_send(ctx, MAGIC_PASSPHRASE_CONFIRM, passphrase, passphrase_len)) != MBED_ERROR_NONE)) {
+                goto failed;
+            }
+            ctx->state = U2F2_UNLOCK_WAIT_PASSPHRASE;
+            progress = true;
+            break;
+        }
+
+        case U2F2_UNLOCK_WAIT_PASSPHRASE:
+            if (!unlock_recv(ctx, MAGIC_PASSPHRASE_RESULT, &msgbuf, &len, blocking)) {
+                break;
+            }
+            /* only an explicit confirmation is accepted: an empty result (e.g. from a
+             * legacy peer) is not */
+            if (len != 1 || msgbuf.mtext.u8[0] != 0xff) {
+                log_printf("%s: passphrase not confirmed by user\n", __func__);
+                errcode = MBED_ERROR_DENIED;
+                goto failed;
+            }
+            /* the user PIN is asked only once the passphrase is confirmed */
+            if (unlikely((errcode = unlock_send(ctx, MAGIC_USERPIN_INSERT, NULL, 0)) != MBED_ERROR_NONE)) {
+                goto failed;
+            }
+            ctx->state = U2F2_UNLOCK_WAIT_USERPIN;
+            progress = true;
+            break;
+
+        case U2F2_UNLOCK_WAIT_USERPIN:
+            if (!unlock_recv(ctx, MAGIC_USERPIN_INSERTED, &msgbuf, &len, blocking)) {
+                break;
+            }
+            memcpy(&ctx->userpin[0], &msgbuf.mtext.u8[0], len);
+            ctx->userpin_len = len;
+            memset(&msgbuf, 0x0, sizeof(msgbuf));
+            ctx->state = U2F2_UNLOCK_FINALIZE;
+            progress = true;
+            break;
+
+        case U2F2_UNLOCK_FINALIZE:
+            if (!ctx->derive_done) {
+                /* derivation step below */
+                break;
+            }
+            handler_sanity_check_with_panic((physaddr_t)ctx->hooks.userpin);
+            errcode = ctx->hooks.userpin(&ctx->userpin[0], ctx->userpin_len);
+            memset(&ctx->userpin[0], 0x0, sizeof(ctx->userpin));
+            ctx->userpin_len = 0;
+            if (errcode != MBED_ERROR_NONE) {
+                log_printf("%s: user PIN refused\n", __func__);
+                goto failed;
+            }
+            if (unlikely((errcode = unlock_send(ctx, MAGIC_TOKEN_UNLOCKED, NULL, 0)) != MBED_ERROR_NONE)) {
+                goto failed;
+            }
+            ctx->state = U2F2_UNLOCK_DONE;
+            progress = true;
+            break;
+
+        case U2F2_UNLOCK_DONE:
+            goto err;
+
+        case U2F2_UNLOCK_FAILED:
+        default:
+            errcode = MBED_ERROR_INVSTATE;
+            goto err;
+    }
+
+    /* nothing received from the user side: using this time for the key derivation */
+    if (!progress && ctx->derive_started && !ctx->derive_done) {
+        handler_sanity_check_with_panic((physaddr_t)ctx->hooks.derive_step);
+        errcode = ctx->hooks.derive_step();
+        if (errcode == MBED_ERROR_NONE) {
+            ctx->derive_done = true;
+        } else if (errcode == MBED_ERROR_BUSY) {
+            /* derivation work remaining */
+            errcode = MBED_ERROR_NONE;
+        } else {
+            log_printf("%s: key derivation failed\n", __func__);
+            goto failed;
+        }
+    }
+    goto err;
+
+failed:
+    memset(&ctx->userpin[0], 0x0, sizeof(ctx->userpin));
+    ctx->state = U2F2_UNLOCK_FAILED;
+err:
+    /* the passphrase is not left on the stack */
+    memset(passphrase, 0x0, sizeof(passphrase));
+    memset(&msgbuf, 0x0, sizeof(msgbuf));
+    return errcode;
+}
+
+mbed_error_t u2f2_unlock_run(u2f2_unlock_ctx_t *ctx)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+
+    if (ctx == NULL) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+    while (ctx->state != U2F2_UNLOCK_DONE && ctx->state != U2F2_UNLOCK_FAILED) {
+        /* block on the user side only when there is no derivation work to do meanwhile */
+        bool blocking = !(ctx->derive_started && !ctx->derive_done);
+        if ((errcode = u2f2_unlock_step(ctx, blocking)) != MBED_ERROR_NONE) {
+            goto err;
+        }
+    }
+err:
+    return errcode;
+}